@@ -16,12 +16,12 @@
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
 #define DEBUG 1
-#define MAX_BUFF_SIZE MAX_SEG_DATA_SIZE
+#define MAX_BUFF_SIZE MAX_LOCAL_SEG_DATA_SIZE
 #define SEGMENT_HDR_SIZE sizeof(ctcp_segment_t)
 
 
 //char buffer_in[MAX_BUFF_SIZE];
-char buffer_out[MAX_BUFF_SIZE];
+__thread char buffer_out[MAX_BUFF_SIZE];
 enum conn_state {
   WAIT_INPUT,
   DATA_TRANSFER,
@@ -40,7 +40,9 @@ enum teardown_state {
 struct segment_attr {
   uint16_t no_of_times;
   uint16_t time;
-  ctcp_segment_t *segment;
+  ctcp_segment_t *segment;     /* NULL if data is reread from the sent file */
+  uint32_t seqno;
+  int32_t len;
 };
 
 struct tear_down_nums {
@@ -86,13 +88,17 @@ struct ctcp_state {
   uint16_t timer;               /* How often ctcp_timer() is called, in ms */
   uint16_t rt_timeout;          /* Retransmission timeout, in ms */
   ctcp_tear_down_nums_t* tear_down_nums; /* seq and ack of FIN segments */
+  bool send_file;               /* Input is a file mapped by the library */
+  bool recv_file;               /* Output is a file mapped by the library */
+  uint16_t max_seg_size;        /* Most data to put in a segment */
 };
 
 /**
  * Linked list of connection states. Go through this in ctcp_timer() to
- * resubmit segments and tear down connections.
+ * resubmit segments and tear down connections. Each worker thread of a sharded
+ * server has its own.
  */
-static ctcp_state_t *state_list;
+static __thread ctcp_state_t *state_list;
 
 /* FIXME: Feel free to add as many helper functions as needed. Don't repeat
           code! Helper functions make the code clearer and cleaner. */
@@ -134,21 +140,30 @@ static void _save_sent_segment(ctcp_state_t *state, ctcp_segment_t *segment)
   state->sent_segment_attr->segment = segment;
 }
 
-static int16_t _segment_send(ctcp_state_t *state,int32_t flags, int32_t len, char* data)
+static ctcp_segment_t *_segment_build(ctcp_state_t *state,uint32_t seqno,int32_t flags, int32_t len, const char* data)
 {
   int32_t datalen;
   datalen = len - SEGMENT_HDR_SIZE;
   ctcp_segment_t *segment = calloc(len,1);
   segment->len = len;
-  segment->seqno = state->seqno;
+  segment->seqno = seqno;
   segment->ackno = state->ackno;
   segment->flags = flags;
-  segment->window = MAX_SEG_DATA_SIZE;
+  segment->window = state->max_seg_size;
   memcpy(segment->data,data,datalen);
   _segment_hton(segment);
   segment->cksum = 0;
   int32_t sum = cksum(segment,len);
   segment->cksum = sum;
+  return segment;
+}
+
+static int32_t _segment_send(ctcp_state_t *state,int32_t flags, int32_t len, const char* data)
+{
+  int32_t datalen;
+  uint32_t seqno = state->seqno;
+  datalen = len - SEGMENT_HDR_SIZE;
+  ctcp_segment_t *segment = _segment_build(state,seqno,flags,len,data);
   if(conn_send(state->conn,segment,len) < 0)
   {
     return -1;
@@ -167,6 +182,15 @@ static int16_t _segment_send(ctcp_state_t *state,int32_t flags, int32_t len, cha
   }
   if((datalen > 0) || flags&FIN)
   _save_sent_segment(state,segment);
+/* Data of a sent file is reread from the library's mapping when
+   retransmitting, no need to keep a copy */
+  if(state->send_file && datalen > 0)
+  {
+    state->sent_segment_attr->segment = NULL;
+    state->sent_segment_attr->seqno = seqno;
+    state->sent_segment_attr->len = len;
+    free(segment);
+  }
   return len;
 }
 
@@ -224,7 +248,14 @@ void  retransmission_handler(ctcp_state_t *state)
   segment_attr->time += state->timer;
   if(segment_attr->time >= state->rt_timeout)
   {
-    conn_send(state->conn,segment_attr->segment,ntohs(segment_attr->segment->len));
+    ctcp_segment_t *segment = segment_attr->segment;
+    /* Data starts at sequence number 1 */
+    if(segment == NULL)
+      segment = _segment_build(state,segment_attr->seqno,ACK,segment_attr->len,
+                               conn_input_at(state->conn,segment_attr->seqno - 1));
+    conn_send(state->conn,segment,ntohs(segment->len));
+    if(segment != segment_attr->segment)
+      free(segment);
     segment_attr->no_of_times ++;
     if(segment_attr->no_of_times >= 5)
       _destroy_acked_segment(state);
@@ -254,8 +285,11 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->td_state = NOT_TEARDOWN;
   state->timer = cfg->timer;
   state->rt_timeout = cfg->rt_timeout;
+  state->max_seg_size = cfg->max_seg_size;
   state->conn_state = DATA_TRANSFER;
   state->sent_segment_attr = NULL;
+  state->send_file = conn_input_at(conn, 0) != NULL;
+  state->recv_file = conn_output_hwm(conn) >= 0;
   /* hoangtu1: create a linked list of segment */
  // state->sent_segment_attr = calloc(sizeof(ctcp_segment_attr_t),1);
   state->segments_send = ll_create();
@@ -279,9 +313,13 @@ void ctcp_destroy(ctcp_state_t *state) {
 
 void ctcp_read(ctcp_state_t *state) {
   uint32_t retval,len,flags = 0;
-  bzero(buffer_out,MAX_BUFF_SIZE);
+  const char *data = buffer_out;
+  bzero(buffer_out,state->max_seg_size);
   if (state->sent_segment_attr == NULL){
-  retval = conn_input(state->conn, buffer_out, MAX_BUFF_SIZE);
+  if (state->send_file)
+    retval = conn_input_map(state->conn, &data, state->max_seg_size);
+  else
+    retval = conn_input(state->conn, buffer_out, state->max_seg_size);
   if (-1 == retval) 
   {
     flags = FIN;
@@ -295,7 +333,7 @@ void ctcp_read(ctcp_state_t *state) {
   {
     len = retval + SEGMENT_HDR_SIZE;
     flags = ACK;
-    if((retval=_segment_send(state, flags, len, buffer_out)) < 0)
+    if((retval=_segment_send(state, flags, len, data)) < 0)
     {      
 
     }
@@ -348,10 +386,31 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
       {
         state->ackno = segment->seqno;
         _destroy_acked_segment(state);
-        free(segment);
+        segment_free(segment);
+      }
+      else if(state->recv_file){
+/* Place data straight into the file at its offset (data starts at sequence
+   number 1), then ACK everything received in order */
+      if(conn_output_at(state->conn,segment->seqno - 1,segment->data,
+                        segment->len - SEGMENT_HDR_SIZE) < 0)
+      {
+        fprintf(stderr,"Cannot output\n");
+        segment_free(segment);
+        ctcp_destroy(state);
+        return;
+      }
+      state->ackno = conn_output_hwm(state->conn) + 1;
+      if(_segment_send(state,ACK,SEGMENT_HDR_SIZE,NULL) < 0)
+      {
+        perr("Cannot send ACK segment\n");
+      }
+      _destroy_acked_segment(state);
+      segment_free(segment);
       }
       else{
-/*Send data to STDOUT */
+/*Send data to STDOUT, replacing a copy still held back */
+      if (state->received_segment != NULL)
+        segment_free(state->received_segment);
       state->received_segment = segment;
       ctcp_output(state);
       }
@@ -414,21 +473,21 @@ exit_receive: return;
 
 void ctcp_output(ctcp_state_t *state) {
   uint32_t avail_buf,datalen;
+/* Nothing held back waiting for buffer space */
+  if (state->received_segment == NULL)
+    return;
   datalen = state->received_segment->len - SEGMENT_HDR_SIZE;
   avail_buf = conn_bufspace(state->conn);
-  if (avail_buf == 0)
-  {
-    fprintf(stderr,"No available buffer \n");
-    free(state->received_segment);
-    return;
-  }
+/* Not enough room: hold the segment unACKed until the library calls back
+   after draining some of the output */
   if(avail_buf >= datalen)
   {
     if(datalen == 0)
       {
         state->ackno = state->received_segment->seqno;
         _destroy_acked_segment(state);
-        free(state->received_segment);
+        segment_free(state->received_segment);
+        state->received_segment = NULL;
       }
     else {
     if(conn_output(state->conn,state->received_segment->data,datalen) < 0)
@@ -444,17 +503,20 @@ void ctcp_output(ctcp_state_t *state) {
       perr("Cannot send ACK segment\n");
     }
     _destroy_acked_segment(state);
-    free(state->received_segment);
+    segment_free(state->received_segment);
+    state->received_segment = NULL;
     }
   }
 }
 
 void ctcp_timer() {
   /* FIXME */
-  ctcp_state_t *state = state_list;
+  ctcp_state_t *state = state_list, *next;
   while(NULL != state)
   {
+    /* The handler may destroy the state */
+    next = state->next;
     retransmission_handler(state);
-    state = state_list->next;
+    state = next;
   }
 }
@@ -25,8 +25,13 @@
  *
  * A sliding window of size n * MAX_SEG_DATA_SIZE may have more than n segments,
  * if not all the segments are of the full MAX_SEG_DATA_SIZE in size.
+ *
+ * Hosts on the same machine agree on larger segments during the handshake, up
+ * to MAX_LOCAL_SEG_DATA_SIZE. Use max_seg_size in ctcp_config_t, which is the
+ * size agreed on for the connection, in place of MAX_SEG_DATA_SIZE.
  */
 #define MAX_SEG_DATA_SIZE 1440
+#define MAX_LOCAL_SEG_DATA_SIZE 65495
 
 /**
  * cTCP flags.
@@ -52,11 +57,14 @@
  */
 typedef struct {
   uint16_t recv_window;    /* Receive window size (in multiples of
-                              MAX_SEG_DATA_SIZE) of THIS host. For Lab 1 this
-                              value will be 1 * MAX_SEG_DATA_SIZE */
+                              max_seg_size) of THIS host. For Lab 1 this
+                              value will be 1 * max_seg_size */
   uint16_t send_window;    /* Send window size (a.k.a. receive window size of
                               the OTHER host). For Lab 1 this value
-                              will be 1 * MAX_SEG_DATA_SIZE */
+                              will be 1 * max_seg_size */
+  uint16_t max_seg_size;   /* Most data to put in a segment, as agreed with
+                              the OTHER host. MAX_SEG_DATA_SIZE unless both
+                              hosts are on the same machine */
   int timer;               /* How often ctcp_timer() is called, in ms */
   int rt_timeout;          /* Retransmission timeout, in ms */
 } ctcp_config_t;
@@ -137,15 +145,16 @@ void ctcp_read(ctcp_state_t *state);
  * ACKs accordingly and output the segment's data to STDOUT if there is data.
  * To output, call on ctcp_output(), which you also must implement.
  *
- * The received segment MUST BE FREED after you are done with it.
+ * The received segment MUST BE FREED with segment_free() after you are done
+ * with it.
  *
  * If you receive a FIN segment, you should output an EOF by calling
  * conn_output() with a length of 0. Then, you will need to destroy any
  * connection state once the conditions are satisfied (see ctcp_destroy()).
  *
  * state: Associated connection state.
- * segment: Segment received from the server. You should free this when you are
- *          done with it.
+ * segment: Segment received from the server. You should free this with
+ *          segment_free() when you are done with it.
  * len: Length of the segment (including the headers). There might be extra
  *      padding so the received length might be larger than the length field in
  *      the segment header. The segment may have also been truncated (len is
@@ -0,0 +1,398 @@
+/******************************************************************************
+ * ctcp_bench.c
+ * ------------
+ * Throughput benchmark for cTCP. Pushes a number of bytes from a client to a
+ * server under a matrix of window sizes, segment sizes and unreliability
+ * rates, checks that everything arrived intact, and prints one CSV line per
+ * run.
+ *
+ * Runs use the in-process loopback transport (see --loopback), so they need
+ * neither sudo nor free ports, and measure the protocol and the library rather
+ * than the kernel's socket paths.
+ *
+ * Columns:
+ *   window       Window size, in segments (-w)
+ *   mss          Most data in a segment (--mss)
+ *   drop         Drop percentage (--drop)
+ *   corrupt      Corrupt percentage (--corrupt)
+ *   run          Run number, for repeated runs
+ *   bytes        Bytes pushed through
+ *   ok           1 if everything arrived intact, 0 otherwise
+ *   seconds      Time until the last byte arrived
+ *   mb_per_s     Goodput, in MB/s (10^6 bytes)
+ *   retx_ratio   Fraction of data bytes sent that were retransmissions
+ *   cpu_s_per_gb User and system CPU time of cTCP per GB (10^9 bytes)
+ *   peak_rss_kb  Peak resident set size of cTCP, in KB
+ *
+ * To compile, do the following:
+ *     make ctcp_bench
+ *
+ * To run the default matrix, do the following:
+ *     make bench
+ *
+ * Or, to pick the matrix:
+ *     ./ctcp_bench [-b bytes] [-w windows] [-m mss] [-r drops] [-t corrupts]
+ *                  [-n runs] [-s timeout_sec] [-c ctcp_binary]
+ *                  [-x "more ctcp args"]
+ *
+ * Lists are comma-separated, e.g. -w 1,4,16. The exit status is non-zero if
+ * any run failed.
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Most values in a list given on the command line. */
+#define MAX_LIST 32
+
+/** Most arguments passed to cTCP. */
+#define MAX_ARGS 64
+
+/** Size of the buffer for cTCP's STDERR. Lines longer than this are cut. */
+#define ERR_BUF_SIZE 4096
+
+/** Options. */
+static size_t num_bytes = 4 * 1024 * 1024;
+static int num_runs = 1;
+static int timeout_sec = 120;
+static char *ctcp_binary = "./ctcp";
+static char *extra_args = NULL;
+
+/** Data pushed through. */
+static char *data;
+
+/** Results of one run. */
+struct result {
+  size_t received;             /* Bytes received */
+  bool ok;                     /* Everything arrived intact */
+  double seconds;              /* Time until the last byte arrived */
+  double cpu;                  /* CPU time, in seconds */
+  long peak_rss;               /* Peak RSS, in KB */
+  unsigned long data_bytes;    /* Data bytes sent (see --stats) */
+};
+
+/**
+ * Parses a comma-separated list of numbers.
+ *
+ * str: The list.
+ * list: Array to store the numbers in.
+ * returns: The number of numbers, or -1 if the list is invalid.
+ */
+int parse_list(char *str, int *list) {
+  int n = 0;
+  char *tok;
+  while ((tok = strsep(&str, ",")) != NULL) {
+    if (n == MAX_LIST || *tok == '\0')
+      return -1;
+    list[n++] = atoi(tok);
+  }
+  return n;
+}
+
+/**
+ * Gets the current time of a monotonic clock.
+ *
+ * returns: The time, in seconds.
+ */
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Looks for the line printed by --stats in cTCP's STDERR. Full lines are
+ * consumed from the buffer; a partial line is left at its start.
+ *
+ * buf: Buffer of STDERR output.
+ * len: Number of bytes in the buffer.
+ * res: Where to store the counts found.
+ * returns: The number of bytes left in the buffer.
+ */
+size_t scan_stderr(char *buf, size_t len, struct result *res) {
+  char *line = buf, *nl;
+  while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+    *nl = '\0';
+    sscanf(line, "[STATS] segments=%*u data_segments=%*u data_bytes=%lu",
+           &res->data_bytes);
+    line = nl + 1;
+  }
+
+  /* Keep the partial line, unless it fills the whole buffer. */
+  len = buf + len - line;
+  if (len == ERR_BUF_SIZE)
+    len = 0;
+  memmove(buf, line, len);
+  return len;
+}
+
+/**
+ * Runs cTCP once over the loopback transport, pushing the data through it.
+ *
+ * window: Window size.
+ * mss: Most data in a segment.
+ * drop: Drop percentage.
+ * corrupt: Corrupt percentage.
+ * seed: Seed for unreliability.
+ * res: Where to store the results.
+ * returns: 0 on success, -1 if cTCP could not be started.
+ */
+int run(int window, int mss, int drop, int corrupt, int seed,
+        struct result *res) {
+  char w_str[16], mss_str[16], drop_str[16], corrupt_str[16], seed_str[16];
+  char *argv[MAX_ARGS];
+  int argc = 0;
+  snprintf(w_str, sizeof(w_str), "%d", window);
+  snprintf(mss_str, sizeof(mss_str), "%d", mss);
+  snprintf(drop_str, sizeof(drop_str), "%d", drop);
+  snprintf(corrupt_str, sizeof(corrupt_str), "%d", corrupt);
+  snprintf(seed_str, sizeof(seed_str), "%d", seed);
+
+  argv[argc++] = ctcp_binary;
+  argv[argc++] = "--loopback";
+  argv[argc++] = "--stats";
+  argv[argc++] = "-w";
+  argv[argc++] = w_str;
+  argv[argc++] = "--mss";
+  argv[argc++] = mss_str;
+  argv[argc++] = "--drop";
+  argv[argc++] = drop_str;
+  argv[argc++] = "--corrupt";
+  argv[argc++] = corrupt_str;
+  argv[argc++] = "--seed";
+  argv[argc++] = seed_str;
+
+  /* Extra arguments, split on spaces. */
+  char *extra = extra_args ? strdup(extra_args) : NULL, *rest = extra, *tok;
+  while (rest && (tok = strsep(&rest, " ")) != NULL && argc < MAX_ARGS - 1) {
+    if (*tok != '\0')
+      argv[argc++] = tok;
+  }
+  argv[argc] = NULL;
+
+  /* Pipes for STDIN, STDOUT and STDERR of cTCP. */
+  int in[2], out[2], err[2];
+  if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0) {
+    perror("pipe");
+    return -1;
+  }
+
+  memset(res, 0, sizeof(struct result));
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(err[0]);
+    close(err[1]);
+    execv(ctcp_binary, argv);
+    perror(ctcp_binary);
+    _exit(127);
+  }
+  free(extra);
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+  /* Push the data in, check the data coming out and look for the counts on
+     STDERR, until cTCP closes its output. */
+  char buf[65536], err_buf[ERR_BUF_SIZE];
+  size_t written = 0, err_len = 0;
+  bool intact = true;
+  struct pollfd fds[3] = {
+    { .fd = in[1], .events = POLLOUT },
+    { .fd = out[0], .events = POLLIN },
+    { .fd = err[0], .events = POLLIN }
+  };
+
+  while (fds[1].fd >= 0 || fds[2].fd >= 0) {
+    double left = start + timeout_sec - now();
+    if (left <= 0 || poll(fds, 3, left * 1000) == 0) {
+      fprintf(stderr, "[ERROR] Run timed out\n");
+      kill(pid, SIGKILL);
+      break;
+    }
+
+    if (fds[0].fd >= 0 && fds[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+      ssize_t w = write(in[1], data + written, num_bytes - written);
+      if (w > 0)
+        written += w;
+      if ((w < 0 && errno != EAGAIN) || written == num_bytes) {
+        close(in[1]);
+        fds[0].fd = -1;
+      }
+    }
+
+    if (fds[1].fd >= 0 && fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t r = read(out[0], buf, sizeof(buf));
+      if (r <= 0) {
+        close(out[0]);
+        fds[1].fd = -1;
+      }
+      else {
+        if (res->received + r > num_bytes ||
+            memcmp(buf, data + res->received, r) != 0)
+          intact = false;
+        res->received += r;
+        if (res->received >= num_bytes)
+          res->seconds = now() - start;
+      }
+    }
+
+    if (fds[2].fd >= 0 && fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t r = read(err[0], err_buf + err_len, ERR_BUF_SIZE - err_len);
+      if (r <= 0) {
+        close(err[0]);
+        fds[2].fd = -1;
+      }
+      else {
+        err_len = scan_stderr(err_buf, err_len + r, res);
+      }
+    }
+  }
+
+  if (fds[0].fd >= 0)
+    close(in[1]);
+  if (fds[1].fd >= 0)
+    close(out[0]);
+  if (fds[2].fd >= 0)
+    close(err[0]);
+
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  res->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+             ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  res->peak_rss = ru.ru_maxrss;
+  res->ok = intact && res->received == num_bytes &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  return 0;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-b bytes]\n"
+    "   [-w window1,window2,...]\n"
+    "   [-m mss1,mss2,...]\n"
+    "   [-r drop1,drop2,...]\n"
+    "   [-t corrupt1,corrupt2,...]\n"
+    "   [-n runs]\n"
+    "   [-s timeout_sec]\n"
+    "   [-c ctcp_binary]\n"
+    "   [-x \"more ctcp args\"]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int windows[MAX_LIST] = { 1, 4, 16 };
+  int mss_list[MAX_LIST] = { 1440 };
+  int drops[MAX_LIST] = { 0, 1, 5 };
+  int corrupts[MAX_LIST] = { 0 };
+  int num_windows = 3, num_mss = 1, num_drops = 3, num_corrupts = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:w:m:r:t:n:s:c:x:")) != -1) {
+    switch (opt) {
+    case 'b':
+      num_bytes = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      num_windows = parse_list(optarg, windows);
+      break;
+    case 'm':
+      num_mss = parse_list(optarg, mss_list);
+      break;
+    case 'r':
+      num_drops = parse_list(optarg, drops);
+      break;
+    case 't':
+      num_corrupts = parse_list(optarg, corrupts);
+      break;
+    case 'n':
+      num_runs = atoi(optarg);
+      break;
+    case 's':
+      timeout_sec = atoi(optarg);
+      break;
+    case 'c':
+      ctcp_binary = optarg;
+      break;
+    case 'x':
+      extra_args = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (num_bytes == 0 || num_windows < 0 || num_mss < 0 || num_drops < 0 ||
+      num_corrupts < 0 || num_runs < 1 || timeout_sec < 1)
+    usage(argv[0]);
+
+  /* Same data every time. */
+  size_t i;
+  data = malloc(num_bytes);
+  srand(144);
+  for (i = 0; i < num_bytes; i++)
+    data[i] = rand();
+
+  signal(SIGPIPE, SIG_IGN);
+  printf("window,mss,drop,corrupt,run,bytes,ok,seconds,mb_per_s,retx_ratio,"
+         "cpu_s_per_gb,peak_rss_kb\n");
+  fflush(stdout);
+
+  int w, m, d, c, n;
+  bool failed = false;
+  for (w = 0; w < num_windows; w++) {
+    for (m = 0; m < num_mss; m++) {
+      for (d = 0; d < num_drops; d++) {
+        for (c = 0; c < num_corrupts; c++) {
+          for (n = 0; n < num_runs; n++) {
+            struct result res;
+            if (run(windows[w], mss_list[m], drops[d], corrupts[c], 144 + n,
+                    &res) < 0)
+              return 1;
+
+            double gb = res.received / 1e9;
+            double retx = 0;
+            if (res.data_bytes > res.received)
+              retx = (res.data_bytes - res.received) /
+                     (double) res.data_bytes;
+            printf("%d,%d,%d,%d,%d,%zu,%d,%.3f,%.2f,%.4f,%.2f,%ld\n",
+                   windows[w], mss_list[m], drops[d], corrupts[c], n,
+                   num_bytes, res.ok, res.seconds,
+                   res.ok ? num_bytes / res.seconds / 1e6 : 0, retx,
+                   gb > 0 ? res.cpu / gb : 0, res.peak_rss);
+            fflush(stdout);
+            failed |= !res.ok;
+          }
+        }
+      }
+    }
+  }
+  return failed ? 1 : 0;
+}
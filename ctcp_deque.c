@@ -0,0 +1,98 @@
+#include "ctcp_deque.h"
+
+deque_t *dq_create(size_t elem_size, unsigned int slots) {
+  deque_t *dq = calloc(sizeof(deque_t), 1);
+  dq->elem_size = elem_size;
+  dq->capacity = 1;
+  while (dq->capacity < slots)
+    dq->capacity <<= 1;
+  dq->slots = malloc(dq->capacity * elem_size);
+  return dq;
+}
+
+deque_t *dq_create_window(size_t elem_size, ctcp_config_t *cfg) {
+  unsigned int window = cfg->send_window > cfg->recv_window ?
+                        cfg->send_window : cfg->recv_window;
+  unsigned int seg_size = cfg->max_seg_size ? cfg->max_seg_size :
+                                              MAX_SEG_DATA_SIZE;
+  return dq_create(elem_size, (window + seg_size - 1) / seg_size);
+}
+
+void dq_destroy(deque_t *dq) {
+  if (dq == NULL)
+    return;
+  free(dq->slots);
+  free(dq);
+}
+
+/**
+ * Doubles the size of a full deque. The elements are copied so that the first
+ * one is in the first slot.
+ */
+static void dq_grow(deque_t *dq) {
+  char *slots = malloc(2 * dq->capacity * dq->elem_size);
+  unsigned int first = dq->head & (dq->capacity - 1);
+  unsigned int n = dq->capacity - first;
+
+  memcpy(slots, dq->slots + first * dq->elem_size, n * dq->elem_size);
+  memcpy(slots + n * dq->elem_size, dq->slots, first * dq->elem_size);
+  free(dq->slots);
+  dq->slots = slots;
+  dq->head = 0;
+  dq->capacity *= 2;
+}
+
+void *dq_push_back(deque_t *dq, const void *elem) {
+  if (dq->length == dq->capacity)
+    dq_grow(dq);
+
+  char *slot = dq_slot(dq, dq->head + dq->length);
+  if (elem != NULL)
+    memcpy(slot, elem, dq->elem_size);
+  dq->length++;
+  return slot;
+}
+
+void *dq_push_front(deque_t *dq, const void *elem) {
+  if (dq->length == dq->capacity)
+    dq_grow(dq);
+
+  char *slot = dq_slot(dq, --dq->head);
+  if (elem != NULL)
+    memcpy(slot, elem, dq->elem_size);
+  dq->length++;
+  return slot;
+}
+
+bool dq_pop_front(deque_t *dq, void *elem) {
+  if (dq->length == 0)
+    return false;
+
+  if (elem != NULL)
+    memcpy(elem, dq_slot(dq, dq->head), dq->elem_size);
+  dq->head++;
+  dq->length--;
+  return true;
+}
+
+bool dq_pop_back(deque_t *dq, void *elem) {
+  if (dq->length == 0)
+    return false;
+
+  dq->length--;
+  if (elem != NULL)
+    memcpy(elem, dq_slot(dq, dq->head + dq->length), dq->elem_size);
+  return true;
+}
+
+void *dq_front(deque_t *dq) {
+  return dq_at(dq, 0);
+}
+
+void *dq_back(deque_t *dq) {
+  return dq->length == 0 ? NULL : dq_at(dq, dq->length - 1);
+}
+
+unsigned int dq_length(deque_t *dq) {
+  return dq->length;
+}
@@ -0,0 +1,152 @@
+/******************************************************************************
+ * ctcp_deque.h
+ * ------------
+ * Ring buffer deque functions. Use these to keep a bounded FIFO of fixed-size
+ * elements, such as a retransmission queue or a reassembly buffer.
+ *
+ * Elements are stored by value in one contiguous array of slots whose size is
+ * a power of two, so scanning the deque walks memory in order instead of
+ * following pointers. Adding and removing at either end never allocates unless
+ * the deque is full, in which case it doubles in size.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_DEQUE_H
+#define CTCP_DEQUE_H
+
+#include "ctcp_sys.h"
+#include "ctcp.h"
+
+/** A ring buffer deque. */
+struct deque {
+  char *slots;               /* Storage for capacity elements */
+  size_t elem_size;          /* Size of each element, in bytes */
+  unsigned int capacity;     /* Number of slots, a power of two */
+  unsigned int head;         /* Index of the first element. Only ever
+                                incremented or decremented, and masked with
+                                capacity - 1 when used */
+  unsigned int length;       /* Number of elements */
+};
+typedef struct deque deque_t;
+
+
+/**
+ * Creates a new deque and returns it. This must be freed later with
+ * dq_destroy().
+ *
+ * elem_size: Size of each element, in bytes.
+ * slots: Number of elements to make room for. Rounded up to a power of two.
+ * returns: The new deque.
+ */
+deque_t *dq_create(size_t elem_size, unsigned int slots);
+
+/**
+ * Creates a new deque with room for a window's worth of full segments, as
+ * set by a cTCP configuration. This must be freed later with dq_destroy().
+ *
+ * elem_size: Size of each element, in bytes.
+ * cfg: The configuration. The larger of its send and receive windows is used.
+ * returns: The new deque.
+ */
+deque_t *dq_create_window(size_t elem_size, ctcp_config_t *cfg);
+
+/**
+ * Destroys a deque and frees the memory taken by its elements.
+ *
+ * dq: The deque to destroy.
+ */
+void dq_destroy(deque_t *dq);
+
+/**
+ * Adds an element to the back of the deque. Returns the slot it was put in,
+ * which stays valid until the element is removed or the deque grows.
+ *
+ * dq: The deque to add to.
+ * elem: The element to copy in. If NULL, the slot is left for you to fill in.
+ * returns: The slot containing the element.
+ */
+void *dq_push_back(deque_t *dq, const void *elem);
+
+/**
+ * Adds an element to the front of the deque. Returns the slot it was put in,
+ * which stays valid until the element is removed or the deque grows.
+ *
+ * dq: The deque to add to.
+ * elem: The element to copy in. If NULL, the slot is left for you to fill in.
+ * returns: The slot containing the element.
+ */
+void *dq_push_front(deque_t *dq, const void *elem);
+
+/**
+ * Removes the element at the front of the deque.
+ *
+ * dq: The deque to remove from.
+ * elem: Where to copy the element to. May be NULL.
+ * returns: true if an element was removed, false if the deque was empty.
+ */
+bool dq_pop_front(deque_t *dq, void *elem);
+
+/**
+ * Removes the element at the back of the deque.
+ *
+ * dq: The deque to remove from.
+ * elem: Where to copy the element to. May be NULL.
+ * returns: true if an element was removed, false if the deque was empty.
+ */
+bool dq_pop_back(deque_t *dq, void *elem);
+
+/**
+ * Returns the slot at an index, which is masked to fit the deque. There is no
+ * check that the slot holds an element.
+ *
+ * dq: The deque.
+ * index: Index of the slot, e.g. dq->head + i for the i-th element.
+ * returns: The slot.
+ */
+static inline void *dq_slot(deque_t *dq, unsigned int index) {
+  return dq->slots + (index & (dq->capacity - 1)) * dq->elem_size;
+}
+
+/**
+ * Returns the element a number of places from the front of the deque, so
+ * dq_at(dq, 0) is the first element.
+ *
+ * dq: The deque.
+ * i: Offset from the front.
+ * returns: The element, NULL if i is past the end.
+ */
+static inline void *dq_at(deque_t *dq, unsigned int i) {
+  if (i >= dq->length)
+    return NULL;
+  return dq_slot(dq, dq->head + i);
+}
+
+/**
+ * Loops over every element of a deque, from front to back. Elements must not
+ * be added or removed inside the loop. Use this to iterate over the deque.
+ *
+ * dq: The deque to loop over.
+ * i: Variable of type unsigned int set to each element's offset from the
+ *    front.
+ * elem: Pointer variable set to each element in turn.
+ */
+#define dq_for_each(dq, i, elem) \
+  for ((i) = 0; (i) < (dq)->length && \
+       ((elem) = dq_slot((dq), (dq)->head + (i)), 1); (i)++)
+
+/**
+ * Returns the first element in the deque, NULL if it is empty.
+ */
+void *dq_front(deque_t *dq);
+
+/**
+ * Returns the last element in the deque, NULL if it is empty.
+ */
+void *dq_back(deque_t *dq);
+
+/**
+ * Returns the number of elements in the deque.
+ */
+unsigned int dq_length(deque_t *dq);
+
+#endif /* CTCP_DEQUE_H */
@@ -0,0 +1,41 @@
+/******************************************************************************
+ * ctcp_echo.c
+ * -----------
+ * Echo program for the latency benchmark (see ctcp_latency.c). This
+ * application is started on the server. Everything the client sends is
+ * written straight back, without buffering.
+ *
+ * To compile, do the following:
+ *     make ctcp_echo
+ *
+ * To run, do the following:
+ *     ./ctcp -s -p [server port] -- ./ctcp_echo          Server Configuration
+ *     ./ctcp -c localhost:[server port] -p [client port]  Client Configuration
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+#include <unistd.h>
+
+int main() {
+  char buf[65536];
+
+  while (1) {
+    ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return 0;
+
+    /* Write all of it back. */
+    ssize_t w, done = 0;
+    while (done < r) {
+      w = write(STDOUT_FILENO, buf + done, r - done);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w < 0)
+        return 1;
+      done += w;
+    }
+  }
+}
@@ -0,0 +1,459 @@
+/******************************************************************************
+ * ctcp_latency.c
+ * --------------
+ * Request/response latency benchmark for cTCP. Starts a server that runs the
+ * echo program (ctcp_echo) for every client, then has a number of clients
+ * each send fixed-size messages one at a time, timing how long it takes for
+ * every message to come back. Prints one CSV line per message size and number
+ * of concurrent clients.
+ *
+ * This goes through the real client, server and program paths (sockets,
+ * execute_program() and its pipes), so round-trip times include poll
+ * intervals, pipe hops and when ACKs go out. Like any other cTCP run, it must
+ * be run with sudo.
+ *
+ * Columns:
+ *   size         Message size, in bytes
+ *   clients      Number of concurrent clients
+ *   messages     Number of messages timed (after warm-up)
+ *   ok           1 if every message came back intact, 0 otherwise
+ *   p50_us       Median round-trip time, in microseconds
+ *   p99_us       99th percentile round-trip time
+ *   p999_us      99.9th percentile round-trip time
+ *   max_us       Longest round-trip time
+ *   mean_us      Mean round-trip time
+ *
+ * To compile, do the following:
+ *     make ctcp_latency ctcp_echo
+ *
+ * To run the default matrix, do the following:
+ *     sudo make bench-latency
+ *
+ * Or, to pick the matrix:
+ *     sudo ./ctcp_latency [-m sizes] [-k clients] [-n messages] [-u warmup]
+ *                         [-p base_port] [-s timeout_sec] [-c ctcp_binary]
+ *                         [-e echo_binary] [-x "more ctcp args"]
+ *
+ * Lists are comma-separated, e.g. -m 1,1440,8192. Every combination uses
+ * fresh ports, counting up from the base port. The exit status is non-zero
+ * if any combination failed.
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Most values in a list given on the command line. */
+#define MAX_LIST 32
+
+/** Most arguments passed to cTCP. */
+#define MAX_ARGS 64
+
+/** Most concurrent clients. Same as MAX_NUM_CLIENTS of the server. */
+#define MAX_CLIENTS 10
+
+/** Printed by a client once it has connected. */
+#define CONNECTED "[INFO] Connected to server"
+
+/** Options. */
+static int num_messages = 1000;
+static int num_warmup = 20;
+static int base_port = 20000;
+static int timeout_sec = 120;
+static char *ctcp_binary = "./ctcp";
+static char *echo_binary = "./ctcp_echo";
+static char *extra_args = NULL;
+
+/** A running cTCP process and pipes to its STDIN, STDOUT and STDERR. */
+struct proc {
+  pid_t pid;
+  int in;
+  int out;
+  int err;
+};
+
+/** State of a client. */
+struct client {
+  struct proc proc;
+  bool connected;              /* Printed CONNECTED */
+  size_t match;                /* Bytes of CONNECTED matched so far */
+  int sent;                    /* Messages sent */
+  size_t written;              /* Bytes of the current message written */
+  size_t received;             /* Bytes of the current message received */
+  double sent_at;              /* When the current message was sent */
+};
+
+/**
+ * Parses a comma-separated list of numbers.
+ *
+ * str: The list.
+ * list: Array to store the numbers in.
+ * returns: The number of numbers, or -1 if the list is invalid.
+ */
+int parse_list(char *str, int *list) {
+  int n = 0;
+  char *tok;
+  while ((tok = strsep(&str, ",")) != NULL) {
+    if (n == MAX_LIST || *tok == '\0')
+      return -1;
+    list[n++] = atoi(tok);
+  }
+  return n;
+}
+
+/**
+ * Gets the current time of a monotonic clock.
+ *
+ * returns: The time, in seconds.
+ */
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Starts cTCP with the given arguments followed by the extra arguments (-x),
+ * with pipes to its STDIN, STDOUT and STDERR.
+ *
+ * args: Arguments, ending with NULL. Arguments after "--" are passed on to a
+ *       program, so the extra arguments go before them.
+ * proc: Where to store the process and pipes.
+ * returns: 0 on success, -1 on failure.
+ */
+int start(char **args, struct proc *proc) {
+  char *argv[MAX_ARGS];
+  int argc = 0;
+  argv[argc++] = ctcp_binary;
+  for (; *args && strcmp(*args, "--") != 0; args++)
+    argv[argc++] = *args;
+
+  char *extra = extra_args ? strdup(extra_args) : NULL, *rest = extra, *tok;
+  while (rest && (tok = strsep(&rest, " ")) != NULL && argc < MAX_ARGS / 2) {
+    if (*tok != '\0')
+      argv[argc++] = tok;
+  }
+  for (; *args && argc < MAX_ARGS - 1; args++)
+    argv[argc++] = *args;
+  argv[argc] = NULL;
+
+  int in[2], out[2], err[2];
+  if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0) {
+    perror("pipe");
+    return -1;
+  }
+
+  proc->pid = fork();
+  if (proc->pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (proc->pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(err[0]);
+    close(err[1]);
+    execv(ctcp_binary, argv);
+    perror(ctcp_binary);
+    _exit(127);
+  }
+  free(extra);
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  proc->in = in[1];
+  proc->out = out[0];
+  proc->err = err[0];
+  fcntl(proc->in, F_SETFL, O_NONBLOCK);
+  fcntl(proc->out, F_SETFL, O_NONBLOCK);
+  fcntl(proc->err, F_SETFL, O_NONBLOCK);
+  return 0;
+}
+
+/**
+ * Kills a cTCP process and closes its pipes.
+ *
+ * proc: The process.
+ */
+void stop(struct proc *proc) {
+  kill(proc->pid, SIGKILL);
+  waitpid(proc->pid, NULL, 0);
+  if (proc->in >= 0)
+    close(proc->in);
+  close(proc->out);
+  close(proc->err);
+}
+
+/**
+ * Compares doubles for qsort().
+ */
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Gets a percentile of sorted values.
+ *
+ * v: The values, sorted.
+ * n: Number of values.
+ * q: The percentile, between 0 and 1.
+ * returns: The smallest value that at least q of the values are at or below.
+ */
+double percentile(double *v, int n, double q) {
+  double x = q * n;
+  int i = (int) x;
+  if (i < x)
+    i++;
+  return v[i > 0 ? i - 1 : 0];
+}
+
+/**
+ * Runs one combination of message size and number of clients.
+ *
+ * size: Message size.
+ * num_clients: Number of concurrent clients.
+ * port: First port to use.
+ * returns: Whether every message came back intact.
+ */
+bool run(int size, int num_clients, int port) {
+  char port_str[16], server_str[32], client_port_str[MAX_CLIENTS][16];
+  struct proc server;
+  struct client clients[MAX_CLIENTS];
+  int i;
+
+  /* The server's STDIN stays open, but nothing is written to it. */
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  char *server_args[] = { "-s", "-p", port_str, "--", echo_binary, NULL };
+  if (start(server_args, &server) < 0)
+    return false;
+
+  snprintf(server_str, sizeof(server_str), "localhost:%d", port);
+  memset(clients, 0, sizeof(clients));
+  for (i = 0; i < num_clients; i++) {
+    snprintf(client_port_str[i], 16, "%d", port + 1 + i);
+    char *client_args[] = { "-c", server_str, "-p", client_port_str[i], NULL };
+    if (start(client_args, &clients[i].proc) < 0)
+      return false;
+  }
+
+  /* Message to send, and where replies go. */
+  char *msg = malloc(size), *reply = malloc(size);
+  for (i = 0; i < size; i++)
+    msg[i] = 'a' + i % 26;
+  double *rtts = calloc(num_clients * num_messages, sizeof(double));
+  int num_rtts = 0, done = 0;
+  bool ok = true;
+
+  /* Each client sends a message once connected and the previous one has come
+     back. Drain everyone's STDERR, since student code may print a lot. */
+  struct pollfd fds[3 * MAX_CLIENTS + 1];
+  char buf[65536];
+  double deadline = now() + timeout_sec;
+  while (done < num_clients) {
+    int n = 0;
+    fds[n].fd = server.err;
+    fds[n++].events = POLLIN;
+    for (i = 0; i < num_clients; i++) {
+      struct client *c = &clients[i];
+      bool sending = c->connected && c->written < (size_t) size &&
+                     c->sent < num_warmup + num_messages;
+      fds[n].fd = sending ? c->proc.in : -1;
+      fds[n++].events = POLLOUT;
+      fds[n].fd = c->proc.out;
+      fds[n++].events = POLLIN;
+      fds[n].fd = c->proc.err;
+      fds[n++].events = POLLIN;
+    }
+
+    double left = deadline - now();
+    if (left <= 0 || poll(fds, n, left * 1000) == 0) {
+      fprintf(stderr, "[ERROR] Run timed out\n");
+      ok = false;
+      break;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      if (read(server.err, buf, sizeof(buf)) <= 0) {
+        fprintf(stderr, "[ERROR] Server exited\n");
+        ok = false;
+        break;
+      }
+    }
+
+    for (i = 0; i < num_clients; i++) {
+      struct client *c = &clients[i];
+      struct pollfd *f = &fds[1 + 3 * i];
+      ssize_t r;
+
+      /* Look for the client connecting. */
+      if (f[2].revents & (POLLIN | POLLHUP)) {
+        r = read(c->proc.err, buf, sizeof(buf));
+        int j;
+        for (j = 0; j < r && !c->connected; j++) {
+          c->match = buf[j] == CONNECTED[c->match] ? c->match + 1 :
+                     buf[j] == CONNECTED[0];
+          c->connected = c->match == strlen(CONNECTED);
+        }
+      }
+
+      /* Send the current message. */
+      if (f[0].revents & (POLLOUT | POLLERR)) {
+        if (c->written == 0)
+          c->sent_at = now();
+        r = write(c->proc.in, msg + c->written, size - c->written);
+        if (r > 0)
+          c->written += r;
+      }
+
+      /* Reply. Done with the message once all of it has come back. */
+      if (f[1].revents & (POLLIN | POLLHUP)) {
+        r = read(c->proc.out, reply + c->received, size - c->received);
+        if (r == 0 || (r < 0 && errno != EAGAIN)) {
+          fprintf(stderr, "[ERROR] Client %d exited\n", i);
+          ok = false;
+          done = num_clients;
+          break;
+        }
+        if (r > 0)
+          c->received += r;
+        if (c->received == (size_t) size) {
+          if (memcmp(msg, reply, size) != 0)
+            ok = false;
+          if (c->sent >= num_warmup)
+            rtts[num_rtts++] = now() - c->sent_at;
+          c->sent++;
+          c->written = 0;
+          c->received = 0;
+          if (c->sent == num_warmup + num_messages)
+            done++;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < num_clients; i++)
+    stop(&clients[i].proc);
+  stop(&server);
+
+  /* Results, in microseconds. */
+  double sum = 0;
+  qsort(rtts, num_rtts, sizeof(double), cmp_double);
+  for (i = 0; i < num_rtts; i++) {
+    rtts[i] *= 1e6;
+    sum += rtts[i];
+  }
+  ok = ok && num_rtts == num_clients * num_messages;
+  if (num_rtts > 0) {
+    printf("%d,%d,%d,%d,%.0f,%.0f,%.0f,%.0f,%.0f\n", size, num_clients,
+           num_rtts, ok, percentile(rtts, num_rtts, 0.5),
+           percentile(rtts, num_rtts, 0.99), percentile(rtts, num_rtts, 0.999),
+           rtts[num_rtts - 1], sum / num_rtts);
+  }
+  else {
+    printf("%d,%d,0,0,,,,,\n", size, num_clients);
+  }
+  fflush(stdout);
+
+  free(msg);
+  free(reply);
+  free(rtts);
+  return ok;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-m size1,size2,...]\n"
+    "   [-k clients1,clients2,...]\n"
+    "   [-n messages]\n"
+    "   [-u warmup_messages]\n"
+    "   [-p base_port]\n"
+    "   [-s timeout_sec]\n"
+    "   [-c ctcp_binary]\n"
+    "   [-e echo_binary]\n"
+    "   [-x \"more ctcp args\"]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int sizes[MAX_LIST] = { 1, 64, 1440, 8192 };
+  int concurrency[MAX_LIST] = { 1, 4 };
+  int num_sizes = 4, num_concurrency = 2;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:k:n:u:p:s:c:e:x:")) != -1) {
+    switch (opt) {
+    case 'm':
+      num_sizes = parse_list(optarg, sizes);
+      break;
+    case 'k':
+      num_concurrency = parse_list(optarg, concurrency);
+      break;
+    case 'n':
+      num_messages = atoi(optarg);
+      break;
+    case 'u':
+      num_warmup = atoi(optarg);
+      break;
+    case 'p':
+      base_port = atoi(optarg);
+      break;
+    case 's':
+      timeout_sec = atoi(optarg);
+      break;
+    case 'c':
+      ctcp_binary = optarg;
+      break;
+    case 'e':
+      echo_binary = optarg;
+      break;
+    case 'x':
+      extra_args = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (num_sizes < 0 || num_concurrency < 0 || num_messages < 1 ||
+      num_warmup < 0 || base_port <= 0 || timeout_sec < 1)
+    usage(argv[0]);
+
+  int i, j;
+  for (i = 0; i < num_sizes; i++) {
+    for (j = 0; j < num_concurrency; j++) {
+      if (sizes[i] < 1 || concurrency[j] < 1 || concurrency[j] > MAX_CLIENTS)
+        usage(argv[0]);
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  printf("size,clients,messages,ok,p50_us,p99_us,p999_us,max_us,mean_us\n");
+  fflush(stdout);
+
+  bool failed = false;
+  int port = base_port;
+  for (i = 0; i < num_sizes; i++) {
+    for (j = 0; j < num_concurrency; j++) {
+      failed |= !run(sizes[i], concurrency[j], port);
+      port += 1 + concurrency[j];
+    }
+  }
+  return failed ? 1 : 0;
+}
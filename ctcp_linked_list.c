@@ -142,3 +142,49 @@ ll_node_t *ll_back(linked_list_t *list) {
 unsigned int ll_length(linked_list_t *list) {
   return list->length;
 }
+
+void il_init(il_list_t *list) {
+  list->head.next = &list->head;
+  list->head.prev = &list->head;
+  list->length = 0;
+}
+
+void il_add_after(il_list_t *list, il_link_t *at, il_link_t *link) {
+  link->prev = at;
+  link->next = at->next;
+  at->next->prev = link;
+  at->next = link;
+  list->length++;
+}
+
+void il_add(il_list_t *list, il_link_t *link) {
+  il_add_after(list, list->head.prev, link);
+}
+
+void il_add_front(il_list_t *list, il_link_t *link) {
+  il_add_after(list, &list->head, link);
+}
+
+void il_remove(il_list_t *list, il_link_t *link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->next = NULL;
+  link->prev = NULL;
+  list->length--;
+}
+
+il_link_t *il_front(il_list_t *list) {
+  return list->head.next == &list->head ? NULL : list->head.next;
+}
+
+il_link_t *il_back(il_list_t *list) {
+  return list->head.prev == &list->head ? NULL : list->head.prev;
+}
+
+il_link_t *il_next(il_list_t *list, il_link_t *link) {
+  return link->next == &list->head ? NULL : link->next;
+}
+
+unsigned int il_length(il_list_t *list) {
+  return list->length;
+}
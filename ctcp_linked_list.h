@@ -3,11 +3,17 @@
  * ------------------
  * Linked list functions. Use these to manage a linked list of objects.
  *
+ * There are two kinds of list. A linked_list_t allocates a node for every
+ * object added to it. An il_list_t is intrusive: the object embeds an
+ * il_link_t, so adding and removing never allocates, removing needs no search
+ * and walking the list touches only the objects themselves.
+ *
  *****************************************************************************/
 
 #ifndef CTCP_LINKED_LIST_H
 #define CTCP_LINKED_LIST_H
 
+#include <stddef.h>
 #include "ctcp_sys.h"
 
 /** Node in the linked list. */
@@ -120,4 +126,109 @@ ll_node_t *ll_back(linked_list_t *list);
  */
 unsigned int ll_length(linked_list_t *list);
 
+
+/////////////////////////////// INTRUSIVE LIST ////////////////////////////////
+
+/** Link embedded in an object kept on an intrusive list. */
+struct il_link {
+  struct il_link *next;
+  struct il_link *prev;
+};
+typedef struct il_link il_link_t;
+
+/**
+ * An intrusive linked list. It is circular through head, so the first link's
+ * prev and the last link's next point at head.
+ */
+struct il_list {
+  il_link_t head;
+  unsigned int length;
+};
+typedef struct il_list il_list_t;
+
+/**
+ * Returns the object containing a link.
+ *
+ * link: The link.
+ * type: The type of the object.
+ * member: The name of the link within the object.
+ */
+#define il_entry(link, type, member) \
+  ((type *) ((char *) (link) - offsetof(type, member)))
+
+/**
+ * Loops over every link in a list, from front to back. The current link must
+ * not be removed inside the loop.
+ *
+ * list: The list to loop over.
+ * link: Variable of type il_link_t * set to each link in turn.
+ */
+#define il_for_each(list, link) \
+  for ((link) = (list)->head.next; (link) != &(list)->head; \
+       (link) = (link)->next)
+
+/**
+ * Initializes an empty intrusive list. This must be called before the list is
+ * used. There is nothing to destroy; the objects on it MUST be freed by you!
+ *
+ * list: The list to initialize.
+ */
+void il_init(il_list_t *list);
+
+/**
+ * Adds an object to the back of an intrusive list. The object must not be on
+ * a list already.
+ *
+ * list: The list to add to.
+ * link: The link embedded in the object.
+ */
+void il_add(il_list_t *list, il_link_t *link);
+
+/**
+ * Adds an object to the front of an intrusive list. The object must not be on
+ * a list already.
+ *
+ * list: The list to add to.
+ * link: The link embedded in the object.
+ */
+void il_add_front(il_list_t *list, il_link_t *link);
+
+/**
+ * Adds an object to an intrusive list after the specified link. The object
+ * must not be on a list already.
+ *
+ * list: The list to add to.
+ * at: The link to add after.
+ * link: The link embedded in the object.
+ */
+void il_add_after(il_list_t *list, il_link_t *at, il_link_t *link);
+
+/**
+ * Removes an object from the intrusive list it is on, in constant time.
+ *
+ * list: The list to remove from.
+ * link: The link embedded in the object.
+ */
+void il_remove(il_list_t *list, il_link_t *link);
+
+/**
+ * Returns the first link in the list, NULL if the list is empty.
+ */
+il_link_t *il_front(il_list_t *list);
+
+/**
+ * Returns the last link in the list, NULL if the list is empty.
+ */
+il_link_t *il_back(il_list_t *list);
+
+/**
+ * Returns the link after the specified one, NULL if it is the last.
+ */
+il_link_t *il_next(il_list_t *list, il_link_t *link);
+
+/**
+ * Returns the length of the list.
+ */
+unsigned int il_length(il_list_t *list);
+
 #endif /* CTCP_LINKED_LIST_H */
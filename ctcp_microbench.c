@@ -0,0 +1,679 @@
+/******************************************************************************
+ * ctcp_microbench.c
+ * -----------------
+ * Microbenchmarks for the primitives on cTCP's hot paths: cksum(), the
+ * linked lists (ll_* and the intrusive il_*), the ring deque (dq_*),
+ * create_datagram(), convert_to_datagram(), convert_to_ctcp() and
+ * convert_to_ctcp_in_place(), and log_segment(). Each one is warmed up, then timed over many iterations
+ * for each payload size. Prints one CSV line per primitive and payload size.
+ *
+ * The library is compiled into this program (with its main() renamed) so that
+ * its internal functions can be called directly.
+ *
+ * Columns:
+ *   primitive       What was timed
+ *   payload         Payload size, in bytes
+ *   iterations      Number of timed iterations
+ *   ns_per_op       Wall-clock time per call, in nanoseconds
+ *   cycles_per_op   Time stamp counter cycles per call (0 if not available)
+ *   bytes_per_cycle Payload bytes handled per cycle
+ *
+ * To compile, do the following:
+ *     make ctcp_microbench
+ *
+ * To run, do the following:
+ *     make bench-micro
+ *
+ * Or, to pick payload sizes and iterations:
+ *     ./ctcp_microbench [-m size1,size2,...] [-n iterations]
+ *
+ *****************************************************************************/
+
+#define main ctcp_main
+#include "ctcp_sys_internal.c"
+#undef main
+#include "ctcp_linked_list.h"
+#include "ctcp_deque.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/** Most values in a list given on the command line. */
+#define MAX_LIST 32
+
+/** Iterations run before timing. */
+#define WARMUP_ITERATIONS 1000
+
+/** Iterations timed by default. */
+#define ITERATIONS 200000
+
+/** Number of objects on a list that is walked or searched. */
+#define WALK_LENGTH 64
+
+/** Walks timed with what they touch flushed from the caches first. Each one
+    is timed on its own, so fewer are needed. */
+#define COLD_ITERATIONS 2000
+
+/** A queued segment, as kept on either kind of list. */
+struct bench_obj {
+  il_link_t link;              /* Only used on intrusive lists */
+  uint32_t seqno;
+  char data[];
+};
+
+/** A deque element for a queued segment. */
+struct bench_entry {
+  uint32_t seqno;
+  struct bench_obj *obj;
+};
+
+/** Options. */
+static int iterations = ITERATIONS;
+
+/** Results of the current primitive and payload size. */
+static struct timespec bench_start;
+static uint64_t bench_cycles;
+
+/** Keeps results from being optimized away. */
+static volatile uint64_t sink;
+
+/**
+ * Reads the time stamp counter.
+ *
+ * returns: The number of cycles, or 0 if there is no time stamp counter.
+ */
+uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Starts timing.
+ */
+void bench_begin() {
+  clock_gettime(CLOCK_MONOTONIC, &bench_start);
+  bench_cycles = cycles();
+}
+
+/**
+ * Adds the time since bench_begin() to a running total.
+ *
+ * ns: Total wall-clock time, in nanoseconds.
+ * c: Total time stamp counter cycles.
+ */
+void bench_lap(double *ns, uint64_t *c) {
+  *c += cycles() - bench_cycles;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  *ns += (ts.tv_sec - bench_start.tv_sec) * 1e9 +
+         (ts.tv_nsec - bench_start.tv_nsec);
+}
+
+/**
+ * Prints a result.
+ *
+ * name: The primitive.
+ * payload: The payload size.
+ * n: Number of iterations timed.
+ * ns: Wall-clock time of all of them, in nanoseconds.
+ * c: Time stamp counter cycles of all of them.
+ */
+void bench_report(const char *name, int payload, int n, double ns,
+                  uint64_t c) {
+  double cycles_per_op = (double) c / n;
+  printf("%s,%d,%d,%.1f,%.1f,%.3f\n", name, payload, n, ns / n,
+         cycles_per_op, cycles_per_op > 0 ? payload / cycles_per_op : 0);
+  fflush(stdout);
+}
+
+/**
+ * Stops timing and prints a result.
+ *
+ * name: The primitive.
+ * payload: The payload size.
+ */
+void bench_end(const char *name, int payload) {
+  double ns = 0;
+  uint64_t c = 0;
+  bench_lap(&ns, &c);
+  bench_report(name, payload, iterations, ns, c);
+}
+
+/**
+ * Flushes memory out of all of the caches, so that the next access to it goes
+ * to memory. Does nothing where there is no instruction for it. Call
+ * flush_wait() once done flushing.
+ *
+ * p: Start of the memory.
+ * len: Length of the memory.
+ */
+void flush(const void *p, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+  const char *line = (const char *) ((uintptr_t) p & ~(uintptr_t) 63);
+  for (; line < (const char *) p + len; line += 64)
+    _mm_clflush(line);
+#endif
+}
+
+/**
+ * Waits for flush() to be done.
+ */
+void flush_wait() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_mfence();
+#endif
+}
+
+/**
+ * Builds a cTCP segment carrying data.
+ *
+ * payload: Size of the data.
+ * returns: The segment.
+ */
+ctcp_segment_t *make_segment(int payload) {
+  int len = sizeof(ctcp_segment_t) + payload;
+  ctcp_segment_t *segment = calloc(len, 1);
+  int i;
+  segment->seqno = htonl(1);
+  segment->ackno = htonl(1);
+  segment->len = htons(len);
+  segment->flags = TH_ACK;
+  segment->window = htons(MAX_SEG_DATA_SIZE);
+  for (i = 0; i < payload; i++)
+    segment->data[i] = i;
+  segment->cksum = cksum(segment, len);
+  return segment;
+}
+
+/**
+ * Times cksum() over a payload.
+ *
+ * payload: Payload size.
+ */
+void bench_cksum(int payload) {
+  char *data = calloc(payload + 1, 1);
+  int i;
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    sink += cksum(data, payload);
+
+  bench_begin();
+  for (i = 0; i < iterations; i++)
+    sink += cksum(data, payload);
+  bench_end("cksum", payload);
+  free(data);
+}
+
+/**
+ * Times adding a segment to the back of a list and removing one from the
+ * front, as a sender does for every segment.
+ *
+ * payload: Payload size (only printed).
+ */
+void bench_ll(int payload) {
+  linked_list_t *list = ll_create();
+  int i;
+
+  /* Keep a window's worth of segments in the list, like a sender would. */
+  for (i = 0; i < 8; i++)
+    ll_add(list, list);
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    ll_add(list, list);
+    ll_remove(list, ll_front(list));
+  }
+
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    ll_add(list, list);
+    ll_remove(list, ll_front(list));
+  }
+  bench_end("ll_add+ll_remove", payload);
+  ll_destroy(list);
+}
+
+/**
+ * Same as bench_ll(), on an intrusive list.
+ *
+ * payload: Payload size (only printed).
+ */
+void bench_il(int payload) {
+  il_list_t list;
+  struct bench_obj objs[9];
+  int i;
+
+  il_init(&list);
+  for (i = 0; i < 8; i++)
+    il_add(&list, &objs[i].link);
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    il_link_t *front = il_front(&list);
+    il_remove(&list, front);
+    il_add(&list, front);
+  }
+
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    il_link_t *front = il_front(&list);
+    il_remove(&list, front);
+    il_add(&list, front);
+  }
+  bench_end("il_add+il_remove", payload);
+}
+
+/**
+ * Allocates WALK_LENGTH segments with a payload.
+ *
+ * payload: Payload size.
+ * returns: The segments.
+ */
+struct bench_obj **make_objs(int payload) {
+  struct bench_obj **objs = calloc(WALK_LENGTH, sizeof(struct bench_obj *));
+  int i;
+  for (i = 0; i < WALK_LENGTH; i++) {
+    objs[i] = calloc(sizeof(struct bench_obj) + payload, 1);
+    objs[i]->seqno = i;
+  }
+  return objs;
+}
+
+/**
+ * Frees segments from make_objs().
+ */
+void free_objs(struct bench_obj **objs) {
+  int i;
+  for (i = 0; i < WALK_LENGTH; i++)
+    free(objs[i]);
+  free(objs);
+}
+
+/**
+ * Times walking a list of segments, as a sender does to retransmit, and
+ * finding and removing one from the middle, as it does when an ACK arrives.
+ *
+ * payload: Payload size.
+ */
+void bench_ll_walk(int payload) {
+  struct bench_obj **objs = make_objs(payload);
+  linked_list_t *list = ll_create();
+  ll_node_t *node;
+  uint64_t sum;
+  int i;
+  for (i = 0; i < WALK_LENGTH; i++)
+    ll_add(list, objs[i]);
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    sum = 0;
+    for (node = ll_front(list); node; node = node->next)
+      sum += ((struct bench_obj *) node->object)->seqno;
+    sink = sum;
+  }
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    sum = 0;
+    for (node = ll_front(list); node; node = node->next)
+      sum += ((struct bench_obj *) node->object)->seqno;
+    sink = sum;
+  }
+  bench_end("ll_walk", payload);
+
+  double ns = 0;
+  uint64_t c = 0;
+  ll_node_t *next;
+  for (i = 0; i < COLD_ITERATIONS; i++) {
+    for (node = ll_front(list); node; node = next) {
+      next = node->next;
+      flush(node->object, sizeof(struct bench_obj));
+      flush(node, sizeof(ll_node_t));
+    }
+    flush_wait();
+    bench_begin();
+    sum = 0;
+    for (node = ll_front(list); node; node = node->next)
+      sum += ((struct bench_obj *) node->object)->seqno;
+    sink = sum;
+    bench_lap(&ns, &c);
+  }
+  bench_report("ll_walk_cold", payload, COLD_ITERATIONS, ns, c);
+
+  struct bench_obj *middle = objs[WALK_LENGTH / 2];
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    ll_add(list, ll_remove(list, ll_find(list, middle)));
+  bench_begin();
+  for (i = 0; i < iterations; i++)
+    ll_add(list, ll_remove(list, ll_find(list, middle)));
+  bench_end("ll_find+ll_remove", payload);
+
+  ll_destroy(list);
+  free_objs(objs);
+}
+
+/**
+ * Same as bench_ll_walk(), on an intrusive list. No search is needed to
+ * remove a segment.
+ *
+ * payload: Payload size.
+ */
+void bench_il_walk(int payload) {
+  struct bench_obj **objs = make_objs(payload);
+  il_list_t list;
+  il_link_t *link;
+  uint64_t sum;
+  int i;
+  il_init(&list);
+  for (i = 0; i < WALK_LENGTH; i++)
+    il_add(&list, &objs[i]->link);
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    sum = 0;
+    il_for_each(&list, link)
+      sum += il_entry(link, struct bench_obj, link)->seqno;
+    sink = sum;
+  }
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    sum = 0;
+    il_for_each(&list, link)
+      sum += il_entry(link, struct bench_obj, link)->seqno;
+    sink = sum;
+  }
+  bench_end("il_walk", payload);
+
+  double ns = 0;
+  uint64_t c = 0;
+  int j;
+  for (i = 0; i < COLD_ITERATIONS; i++) {
+    for (j = 0; j < WALK_LENGTH; j++)
+      flush(objs[j], sizeof(struct bench_obj));
+    flush_wait();
+    bench_begin();
+    sum = 0;
+    il_for_each(&list, link)
+      sum += il_entry(link, struct bench_obj, link)->seqno;
+    sink = sum;
+    bench_lap(&ns, &c);
+  }
+  bench_report("il_walk_cold", payload, COLD_ITERATIONS, ns, c);
+
+  link = &objs[WALK_LENGTH / 2]->link;
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    il_remove(&list, link);
+    il_add(&list, link);
+  }
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    il_remove(&list, link);
+    il_add(&list, link);
+  }
+  bench_end("il_remove", payload);
+
+  free_objs(objs);
+}
+
+/**
+ * Same as bench_ll(), on a ring deque holding the segments' sequence numbers.
+ *
+ * payload: Payload size (only printed).
+ */
+void bench_dq(int payload) {
+  deque_t *dq = dq_create(sizeof(struct bench_entry), 8);
+  struct bench_entry entry = { 0, NULL };
+  int i;
+
+  for (i = 0; i < 8; i++)
+    dq_push_back(dq, &entry);
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    dq_pop_front(dq, &entry);
+    dq_push_back(dq, &entry);
+  }
+
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    dq_pop_front(dq, &entry);
+    dq_push_back(dq, &entry);
+  }
+  bench_end("dq_push+dq_pop", payload);
+  dq_destroy(dq);
+}
+
+/**
+ * Same as the walks in bench_ll_walk(), on a ring deque. The sequence number
+ * is kept in the deque, so scanning the window does not touch the segments.
+ *
+ * payload: Payload size.
+ */
+void bench_dq_walk(int payload) {
+  struct bench_obj **objs = make_objs(payload);
+  deque_t *dq = dq_create(sizeof(struct bench_entry), WALK_LENGTH);
+  struct bench_entry *entry;
+  unsigned int j;
+  uint64_t sum;
+  int i;
+  for (i = 0; i < WALK_LENGTH; i++) {
+    entry = dq_push_back(dq, NULL);
+    entry->seqno = objs[i]->seqno;
+    entry->obj = objs[i];
+  }
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    sum = 0;
+    dq_for_each(dq, j, entry)
+      sum += entry->seqno;
+    sink = sum;
+  }
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    sum = 0;
+    dq_for_each(dq, j, entry)
+      sum += entry->seqno;
+    sink = sum;
+  }
+  bench_end("dq_walk", payload);
+
+  double ns = 0;
+  uint64_t c = 0;
+  for (i = 0; i < COLD_ITERATIONS; i++) {
+    flush(dq->slots, dq->capacity * dq->elem_size);
+    flush_wait();
+    bench_begin();
+    sum = 0;
+    dq_for_each(dq, j, entry)
+      sum += entry->seqno;
+    sink = sum;
+    bench_lap(&ns, &c);
+  }
+  bench_report("dq_walk_cold", payload, COLD_ITERATIONS, ns, c);
+
+  dq_destroy(dq);
+  free_objs(objs);
+}
+
+/**
+ * Times create_datagram() for a TCP segment carrying a payload.
+ *
+ * payload: Payload size.
+ */
+void bench_create_datagram(int payload) {
+  int i;
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    free(create_datagram(config->ip_addr, LOCALHOST, TCP_HDR_SIZE + payload));
+
+  bench_begin();
+  for (i = 0; i < iterations; i++)
+    free(create_datagram(config->ip_addr, LOCALHOST, TCP_HDR_SIZE + payload));
+  bench_end("create_datagram", payload);
+}
+
+/**
+ * Times convert_to_datagram() on a segment carrying a payload.
+ *
+ * conn: Connection to convert for.
+ * payload: Payload size.
+ */
+void bench_convert_to_datagram(conn_t *conn, int payload) {
+  ctcp_segment_t *segment = make_segment(payload);
+  int len = sizeof(ctcp_segment_t) + payload;
+  int i;
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    free(convert_to_datagram(conn, segment, len));
+
+  bench_begin();
+  for (i = 0; i < iterations; i++)
+    free(convert_to_datagram(conn, segment, len));
+  bench_end("convert_to_datagram", payload);
+  free(segment);
+}
+
+/**
+ * Times convert_to_ctcp() on a datagram carrying a payload.
+ *
+ * conn: Connection to convert for.
+ * payload: Payload size.
+ */
+void bench_convert_to_ctcp(conn_t *conn, int payload) {
+  ctcp_segment_t *segment = make_segment(payload);
+  int len = sizeof(ctcp_segment_t) + payload;
+  char *datagram = convert_to_datagram(conn, segment, len);
+  int i;
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    segment_free(convert_to_ctcp(conn, datagram, FULL_HDR_SIZE + payload));
+
+  bench_begin();
+  for (i = 0; i < iterations; i++)
+    segment_free(convert_to_ctcp(conn, datagram, FULL_HDR_SIZE + payload));
+  bench_end("convert_to_ctcp", payload);
+  free(datagram);
+  free(segment);
+}
+
+/**
+ * Times convert_to_ctcp_in_place() on a datagram carrying a payload. The
+ * headers are put back before each call, as the call rewrites them.
+ *
+ * conn: Connection to convert for.
+ * payload: Payload size.
+ */
+void bench_convert_in_place(conn_t *conn, int payload) {
+  ctcp_segment_t *segment = make_segment(payload);
+  int len = sizeof(ctcp_segment_t) + payload;
+  struct seg_buf *b = seg_buf_get();
+  char hdrs[FULL_HDR_SIZE];
+  int i;
+  fill_datagram(conn, segment, len, b->pkt);
+  memcpy(hdrs, b->pkt, FULL_HDR_SIZE);
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++) {
+    memcpy(b->pkt, hdrs, FULL_HDR_SIZE);
+    sink += convert_to_ctcp_in_place(conn, b->pkt)->cksum;
+  }
+  bench_begin();
+  for (i = 0; i < iterations; i++) {
+    memcpy(b->pkt, hdrs, FULL_HDR_SIZE);
+    sink += convert_to_ctcp_in_place(conn, b->pkt)->cksum;
+  }
+  bench_end("convert_to_ctcp_in_place", payload);
+  seg_buf_put(b);
+  free(segment);
+}
+
+/**
+ * Times log_segment() on a segment carrying a payload, logging to /dev/null.
+ *
+ * conn: Connection to log for.
+ * payload: Payload size.
+ */
+void bench_log_segment(conn_t *conn, int payload) {
+  ctcp_segment_t *segment = make_segment(payload);
+  int len = sizeof(ctcp_segment_t) + payload;
+  int file = open("/dev/null", O_WRONLY);
+  int i;
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    log_segment(file, config->ip_addr, config->port, conn, segment, len, true,
+                true);
+
+  bench_begin();
+  for (i = 0; i < iterations; i++)
+    log_segment(file, config->ip_addr, config->port, conn, segment, len, true,
+                true);
+  bench_end("log_segment", payload);
+  close(file);
+  free(segment);
+}
+
+static void bench_usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-m size1,size2,...]\n"
+    "   [-n iterations]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int sizes[MAX_LIST] = { 0, 64, 512, MAX_SEG_DATA_SIZE };
+  int num_sizes = 4;
+
+  int opt;
+  char *tok;
+  while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+    switch (opt) {
+    case 'm':
+      num_sizes = 0;
+      while ((tok = strsep(&optarg, ",")) != NULL) {
+        if (num_sizes == MAX_LIST || *tok == '\0')
+          bench_usage(argv[0]);
+        sizes[num_sizes++] = atoi(tok);
+      }
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    default:
+      bench_usage(argv[0]);
+    }
+  }
+  if (iterations < 1)
+    bench_usage(argv[0]);
+
+  int i;
+  for (i = 0; i < num_sizes; i++) {
+    if (sizes[i] < 0 || sizes[i] > MAX_SEG_DATA_SIZE)
+      bench_usage(argv[0]);
+  }
+
+  /* Enough of the library's state for a connection over a Unix socket. */
+  struct config cc;
+  memset(&cc, 0, sizeof(cc));
+  config = &cc;
+  config->ip_addr = LOCALHOST;
+  config->port = 9999;
+  conn_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn_setup(&conn, LOCALHOST, 8888, true);
+
+  printf("primitive,payload,iterations,ns_per_op,cycles_per_op,"
+         "bytes_per_cycle\n");
+  for (i = 0; i < num_sizes; i++)
+    bench_cksum(sizes[i]);
+  bench_ll(0);
+  bench_il(0);
+  bench_dq(0);
+  for (i = 0; i < num_sizes; i++) {
+    bench_ll_walk(sizes[i]);
+    bench_il_walk(sizes[i]);
+    bench_dq_walk(sizes[i]);
+  }
+  for (i = 0; i < num_sizes; i++)
+    bench_create_datagram(sizes[i]);
+  for (i = 0; i < num_sizes; i++)
+    bench_convert_to_datagram(&conn, sizes[i]);
+  for (i = 0; i < num_sizes; i++)
+    bench_convert_to_ctcp(&conn, sizes[i]);
+  for (i = 0; i < num_sizes; i++)
+    bench_convert_in_place(&conn, sizes[i]);
+  for (i = 0; i < num_sizes; i++)
+    bench_log_segment(&conn, sizes[i]);
+  return 0;
+}
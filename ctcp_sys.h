@@ -70,6 +70,30 @@ typedef struct ctcp_segment {
  */
 int conn_input(conn_t *conn, void *buf, size_t len);
 
+/**
+ * Call on this instead of conn_input() to get input without copying it, if the
+ * library is sending a file (--send-file). The input is handed out as a pointer
+ * into a read-only mapping of the file, so segments can be built straight from
+ * it. The mapping stays valid until the connection is removed.
+ *
+ * conn: Connection object to identify the eventual destination of this input.
+ * data: Set to point to the input.
+ * len: Maximum number of bytes to get.
+ * returns: -1 if error or EOF, otherwise the number of bytes at *data. Returns
+ *          -1 if no file is being sent.
+ */
+int conn_input_map(conn_t *conn, const char **data, size_t len);
+
+/**
+ * Gets input handed out by conn_input_map() again, for example to retransmit
+ * it, so that it does not need to be kept around.
+ *
+ * conn: Connection object the input was handed out for.
+ * offset: Offset of the input from the start of the input.
+ * returns: Pointer to the input, or NULL if no file is being sent.
+ */
+const char *conn_input_at(conn_t *conn, size_t offset);
+
 /**
  * Call on this to send a cTCP segment to a destination associated with the
  * provided connection object.
@@ -87,6 +111,15 @@ int conn_input(conn_t *conn, void *buf, size_t len);
  */
 int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len);
 
+/**
+ * Frees a segment that was passed to ctcp_receive(). Received segments live
+ * in the buffers they were received into, which are reused; they MUST be freed
+ * with this and not with free().
+ *
+ * segment: The received segment. Nothing is done if it is NULL.
+ */
+void segment_free(ctcp_segment_t *segment);
+
 /**
  * Call on this to produce output from the segments you have received from the
  * associated connection. This will either write output to STDOUT or to the
@@ -109,6 +142,34 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len);
  */
 int conn_output(conn_t *conn, const char *buf, size_t len);
 
+/**
+ * Call on this instead of conn_output() when the library is receiving into a
+ * file (--recv-file) to place data straight at its offset in the file. Data
+ * can be placed in any order and more than once; conn_output_hwm() tells how
+ * much of the start of the file is complete. There is no limit on how much
+ * data can be placed, so conn_bufspace() does not apply. Only the first
+ * connection that is set up receives into the file; the others output to
+ * STDOUT as usual.
+ *
+ * Call conn_output() with a length of 0 to signal an EOF, as usual.
+ *
+ * conn: The associated connection object that sent the data.
+ * offset: Offset of the data from the start of the output.
+ * buf: The buffer containing the data.
+ * len: Number of bytes to place.
+ * returns: -1 if error or not receiving into a file, otherwise len.
+ */
+int conn_output_at(conn_t *conn, size_t offset, const char *buf, size_t len);
+
+/**
+ * Gets the high-water mark of the file being received into: all data before it
+ * has been placed with conn_output_at(), and the data at it has not.
+ *
+ * conn: The connection object.
+ * returns: The high-water mark, or -1 if not receiving into a file.
+ */
+int64_t conn_output_hwm(conn_t *conn);
+
 /**
  * Checks how much space is available in STDOUT for output. conn_output() can
  * only write as many bytes as reported by conn_bufspace(). If you write out
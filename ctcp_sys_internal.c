@@ -10,13 +10,26 @@
  * this file.
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <linux/filter.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <netinet/udp.h>
+
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
 
@@ -36,7 +49,8 @@ struct config {
   struct sockaddr_un sunaddr;  /* Unix socket */
 
   /* Client */
-  conn_t *sconn;               /* Server connection details. */
+  conn_t *sconn;               /* Connections to servers. */
+  conn_t *connecting;          /* Servers still being connected to. */
 
   /* Server */
   conn_t *connections;         /* Connection details for clients connected
@@ -49,12 +63,180 @@ struct config {
 static struct config *config;
 static ctcp_config_t *ctcp_cfg;
 
+/** A packet buffer. Packets are received straight into these, and their
+    headers are rewritten in place into a cTCP segment that ends right where
+    the packet's data starts, so the data is never copied. Free buffers are
+    kept in a pool for each thread. Buffers are also used to hand packets off
+    to worker threads. */
+struct seg_buf {
+  struct seg_buf *next;        /* Next free buffer, or next handed-off
+                                  packet */
+  int len;                     /* Length of a handed-off packet */
+  char pkt[];                  /* The packet, max_packet_size bytes */
+};
+
+/** Offset of the cTCP segment in a packet buffer. */
+#define SEG_OFFSET (FULL_HDR_SIZE - sizeof(ctcp_segment_t))
+
+/** A worker thread of a sharded server. Packets are handed off to workers by
+    the main thread by hash of their source, so each worker owns the
+    connections whose packets it gets and runs its own event loop on them. */
+struct worker {
+  pthread_t thread;
+  int cpu;                     /* CPU to run on, or -1 */
+  int wakeup;                  /* eventfd signalled when packets are queued */
+  bool woken;                  /* Packets queued since the last wakeup */
+
+  pthread_mutex_t lock;        /* Protects the packet queue */
+  struct seg_buf *pkts;        /* Packets handed off to this worker */
+  struct seg_buf **pkts_tail;
+  int num_pkts;
+
+  conn_t *connections;         /* Connections owned by this worker */
+};
+
+/** Worker threads of a sharded server and the CPUs to run them on, the worker
+    of the current thread, and the worker with the most recent connection. The
+    latter is the one that reads from STDIN. */
+static int num_workers = 0;
+static int worker_cpus[MAX_WORKERS];
+static int num_worker_cpus = 0;
+static struct worker *workers = NULL;
+static __thread struct worker *worker = NULL;
+static struct worker *stdin_owner = NULL;
+
+/** Ring of input slots from the input thread to the main thread in pipeline
+    mode. head and tail count slots, and only the main thread moves head and
+    only the input thread moves tail. */
+struct in_ring {
+  struct in_slot {
+    int len;                   /* Bytes in the slot, 0 for EOF */
+    char data[IN_SLOT_SIZE];
+  } *slots;
+  unsigned head;               /* Next slot to hand out */
+  unsigned tail;               /* Next slot to fill */
+  bool held;                   /* The slot before head is still handed out */
+  conn_t *holder;              /* Connection it is handed out to */
+  int ready;                   /* eventfd signalled when a slot is filled */
+  int space;                   /* eventfd signalled when a slot is freed */
+};
+
+/** Ring of output bytes from the main thread to the output thread in pipeline
+    mode. head and tail count bytes; only the output thread moves head and only
+    the main thread moves tail. */
+struct out_ring {
+  char *buf;
+  size_t cap;
+  size_t head;                 /* Next byte to write out */
+  size_t tail;                 /* Next byte to push */
+  bool sleeping;               /* Output thread is waiting for output */
+  bool done;                   /* No more output will be pushed */
+  bool err;                    /* Output thread could not write out */
+  int ready;                   /* eventfd signalled when output is pushed */
+  int space;                   /* eventfd signalled when a full ring drains */
+  pthread_t thread;
+};
+
+/** Pipeline mode (see --pipeline): STDIN is read by an input thread and STDOUT
+    is written out by an output thread, joined to the main thread by rings. */
+static bool pipeline = false;
+static struct in_ring in_ring;
+static struct out_ring out_ring;
+
+/** Loopback mode (see --loopback): a sending and a receiving connection in the
+    same process, passing segments to each other through a queue instead of a
+    socket. The queue owns the segments in it. */
+struct loop_seg {
+  conn_t *dst;                 /* Connection it is for */
+  ctcp_segment_t *segment;     /* The segment */
+  size_t len;                  /* Length of the segment */
+  struct loop_seg *next;
+};
+static bool loopback = false;
+static conn_t *loop_receiver = NULL;
+static struct loop_seg *loop_head = NULL;
+static struct loop_seg **loop_tail = &loop_head;
+
+/** Striping (see --stripes): a client cuts its input into chunks and spreads
+    them over several connections to the same server, each chunk behind a
+    header with its sequence number and length (see STRIPE_HDR_SIZE). The
+    server puts the chunks of all of the stripes back in order and outputs them
+    through one of the connections. */
+struct chunk {
+  uint32_t seq;                /* Sequence number */
+  size_t len;                  /* Length of the data */
+  size_t filled;               /* Data received so far */
+  size_t done;                 /* Data output so far */
+  struct chunk *next;          /* Next chunk, in order */
+  char data[];
+};
+struct stripes {
+  int count;                   /* Number of stripes */
+  int num_conns;               /* Stripes with a connection object */
+  int num_eof;                 /* Stripes that have ended */
+  conn_t *out;                 /* Connection the output goes through */
+  uint32_t next_seq;           /* Chunk to output next */
+  struct chunk *chunks;        /* Chunks not output yet, in order */
+  size_t buffered;             /* Data in them not output yet */
+  size_t written;              /* Data output so far */
+  bool kicking;                /* Calling student code for held stripes */
+};
+
+/** [Client only] Number of stripes, the next chunk to read, and its offset in
+    the file being sent. */
+static int num_stripes = 0;
+static uint32_t stripe_seq = 0;
+static size_t stripe_off = 0;
+
 /** Whether or not a Unix socket is being used instead of a normal socket. */
 static bool unix_socket = true;
 
+/** Whether segments are carried as they are in UDP datagrams instead of in
+    TCP packets on a raw socket, and whether the kernel can split up (GSO)
+    and join up (GRO) the datagrams. */
+static bool udp = false;
+static bool udp_gso = false;
+static bool udp_gro = false;
+
+/** Most data this host takes in a segment (see --mss), offered to the other
+    host in the handshake, and the size of packet buffers that fits it. Each
+    connection uses the smaller of the two hosts' sizes. */
+static uint16_t max_seg_size = 0;
+static size_t max_packet_size = MAX_PACKET_SIZE;
+
+/** Window size of this host, in segments (see -w). */
+static int window = 1;
+
 /** Whether or not the server runs a program. */
 static bool run_program = false;
 
+/** Whether or not the io_uring backend is used instead of poll(). */
+static bool use_uring = false;
+
+/** Initial and maximum size of each connection's output buffer. The buffer
+    only grows past its initial size if the maximum is larger. */
+static size_t out_buf_size = MAX_BUF_SPACE;
+static size_t out_buf_max = 0;
+
+/** Whether or not to vmsplice() output into pipes, and whether STDOUT is a
+    pipe that output is spliced into. */
+static bool opt_splice = false;
+static bool stdout_splice = false;
+static struct splice_pipe stdout_pipe = {
+  STDOUT_FILENO, 0, PTHREAD_MUTEX_INITIALIZER
+};
+
+/** File sent instead of reading from STDIN, mapped into memory. */
+static char *send_file = NULL;
+static char *send_map = NULL;
+static size_t send_size = 0;
+
+/** File received into instead of writing to STDOUT. It is opened up front
+    and handed to the first connection that is set up, which then has it to
+    itself (see recv_file_claim()). */
+static char *recv_path = NULL;
+static int recv_fd = -1;
+
 /** Options for unreliable communications. */
 static int seed = 144;
 static int opt_drop = false;
@@ -62,16 +244,68 @@ static int opt_corrupt = false;
 static int opt_delay = false;
 static int opt_duplicate = false;
 
+/** Link emulation (see --rate, --latency, --jitter, --reorder, --burst-loss and
+    --queue). Each connection has its own link for the segments it sends, so
+    the two directions between a pair of hosts (data and ACKs with --loopback)
+    are separate links. Random choices come from the link's own generator,
+    seeded from --seed and the order the links were set up in, so runs with the
+    same seed see the same links. */
+static bool opt_link = false;
+static long link_rate = 0;         /* Bottleneck rate, in kbit/s (0 for none) */
+static long link_latency = 0;      /* Propagation delay, in microseconds */
+static long link_jitter = 0;       /* Most the delay varies by, in us */
+static double link_reorder = 0;    /* Chance a segment skips the delay */
+static double ge_p = 0;            /* Chance of going from good to bad state */
+static double ge_r = 1;            /* Chance of going from bad to good state */
+static double ge_bad_loss = 1;     /* Chance of loss in the bad state */
+static double ge_good_loss = 0;    /* Chance of loss in the good state */
+static int link_queue = LINK_QUEUE;
+static int num_links = 0;          /* Links set up so far */
+
+/** State of one direction of an emulated link. */
+struct emu_link {
+  uint64_t rand;                   /* State of the random number generator */
+  bool bad;                        /* In the bad state of the loss model */
+  long busy_until;                 /* When the bottleneck is done sending */
+  long last_due;                   /* When the last segment comes out */
+  long *queue;                     /* When queued segments are done sending */
+  int queued;                      /* Number of segments queued */
+  int queue_head;                  /* First queued segment */
+};
+
+/** Counts of what student code sent, printed with --stats when a client is
+    done or a server is interrupted. Used by the benchmarks to work out how
+    much was retransmitted. Each thread keeps its own counts, which are added
+    up when they are printed. */
+static bool opt_stats = false;
+struct stats {
+  unsigned long segments;
+  unsigned long data_segments;
+  unsigned long data_bytes;
+};
+static __thread struct stats *stats = NULL;
+static struct stats *all_stats[MAX_WORKERS + 1];
+static int num_stats = 0;
+
 /** For tester, we only do the unreliability once, deterministically. This is
     set to true once it has occurred. */
-static bool tester_did_unreliable = false;
+static __thread bool tester_did_unreliable = false;
 
 /** Log file. */
 int log_file = -1;
 
 /** Port number of a new connection if a client just connected. Used to avoid
     logging ACK segments in response to a SYN+ACK. */
-static int new_connection = 0;
+static __thread int new_connection = 0;
+
+/** [Client only] What is polled for STDIN and STDOUT once a server is
+    connected (STDIN and STDOUT, or the eventfds of the input and output
+    threads in pipeline mode), whether STDIN has ended, and whether a server
+    could not be connected to. */
+static int stdin_poll_fd = -1;
+static int stdout_poll_fd = -1;
+static bool stdin_eof = false;
+static bool connect_failed = false;
 
 /**
  * Polling configuration:
@@ -79,14 +313,74 @@ static int new_connection = 0;
  *    1    STDOUT
  *    2    Network
  *    3... Program STDOUT/STDERR (if running as server)
+ *
+ * Worker threads poll for packets handed off to them instead of the network.
  */
-static struct pollfd *events;
+static __thread struct pollfd *events;
+
+/** Receive buffers, drained from the socket in batches with recvmmsg(). A
+    buffer whose packet is passed on is replaced with another from the pool
+    before the next batch. */
+static int recv_batch = RECV_BATCH;
+static struct mmsghdr *recv_msgs;
+static struct iovec *recv_iovs;
+static struct seg_buf **recv_slots;
+
+/** [UDP only] Senders of the received datagrams, and GRO buffers and segment
+    sizes. */
+static struct sockaddr_in *recv_addrs;
+static char *recv_gro_bufs;
+static char (*recv_cmsgs)[CMSG_SPACE(sizeof(int))];
+
+/** Free packet buffers. Each thread has its own. */
+static __thread struct seg_buf *seg_pool = NULL;
+static __thread int seg_pool_len = 0;
+static int seg_pool_max = SEG_POOL_MAX;
+
+/** Transmit queue. Datagrams from conn_send() are built in place in the
+    queue's slots and sent with a single sendmmsg() call at the end of each
+    pass through do_loop(), or as soon as the queue is full. Messages before
+    send_head have been sent already. Each slot has room for the IP and TCP
+    headers in front of the largest payload. Each worker thread has its own.
+
+    With UDP GSO, datagrams of the same size to the same destination are sent
+    as one message that the kernel splits up, so messages can span several
+    slots. */
+static int send_batch = SEND_BATCH;
+static __thread int send_queued = 0;
+static __thread int send_nmsgs = 0;
+static __thread int send_head = 0;
+static __thread struct mmsghdr *send_msgs;
+static __thread struct iovec *send_iovs;
+static __thread char *send_bufs;
+static __thread conn_t **send_dsts;
+static __thread char (*send_cmsgs)[CMSG_SPACE(sizeof(uint16_t))];
+static __thread union {
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+} *send_addrs;
+
+/** Segments held back by --delay. They are kept in order of when they are due
+    and sent from the main loop. Each worker thread has its own. */
+struct delayed_seg {
+  long due;                    /* When to send it, in microseconds */
+  conn_t *conn;                /* Connection it is sent on */
+  ctcp_segment_t *segment;     /* The segment */
+  size_t len;                  /* Length of the segment */
+  int level;                   /* Times it was held back or duplicated */
+  struct delayed_seg *next;
+};
+static __thread struct delayed_seg *delayed = NULL;
 
 /** When the last timer timeout occurred. */
-static struct timespec last_timeout;
+static __thread struct timespec last_timeout;
 
-/** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
-static int num_connected = 0;
+/** Number of clients connected. MAX_NUM_CLIENTS can be connected (to each
+    worker thread). */
+static __thread int num_connected = 0;
+
+/** Whether a filter is attached to the raw socket. */
+static bool filter_attached = false;
 
 /** Main thread and thread for sending rests. */
 static pthread_t thread_main;
@@ -100,16 +394,147 @@ static bool handling_resets = false;
  * Get the connections for the client or server.
  *
  * returns: A pointer to the start of the linked list of connections (for the
- *          server), or to the connection to the server (for the client).
+ *          server), or of the connections to servers (for the client).
  */
 conn_t *get_connections() {
+  if (worker)  return worker->connections;
   if (SERVER)  return config->connections;
   else         return config->sconn;
 }
 
+/**
+ * Finds the connection with a host in a list of connections.
+ *
+ * list: The list of connections.
+ * ip_addr: IP address of the host. Not checked for Unix sockets.
+ * port: Port of the host.
+ * stripe: Stripe the connection carries (see conn_t), or 0.
+ * returns: The connection, or NULL if there is none.
+ */
+conn_t *conn_find(conn_t *list, in_addr_t ip_addr, int port, uint16_t stripe) {
+  for (; list != NULL; list = list->next) {
+    if (list->port == port && (unix_socket || list->ip_addr == ip_addr) &&
+        list->stripe == stripe)
+      return list;
+  }
+  return NULL;
+}
+
+/**
+ * Agrees on the most data to put in a segment of a connection: the smaller of
+ * what each host takes.
+ *
+ * theirs: Most data the other host takes in a segment.
+ * returns: The segment size of the connection.
+ */
+uint16_t seg_size_agree(uint16_t theirs) {
+  return theirs < max_seg_size ? theirs : max_seg_size;
+}
+
+/**
+ * [Raw socket only]
+ * Attaches a classic BPF filter to the raw socket, replacing any previous
+ * one. The raw socket gets every TCP packet on the host, so without it each
+ * one is copied to us only to be dropped by filter_pkt(). The filter accepts
+ * packets to our port that are SYNs, RSTs, or from one of our connections. If
+ * there are too many connections, or they are spread over worker threads, it
+ * only checks the port. Called again as connections come and go.
+ */
+void filter_update() {
+  struct sock_filter prog[7 + 4 * FILTER_MAX_CONNS + 2];
+  in_addr_t addrs[FILTER_MAX_CONNS];
+  uint16_t ports[FILTER_MAX_CONNS];
+  int num_conns = 0, n = 0, i;
+  bool port_only = num_workers > 0;
+  conn_t *conn;
+
+  if (unix_socket || worker)
+    return;
+  for (conn = get_connections(); conn && !port_only; conn = conn->next) {
+    if (conn->port == 0)
+      continue;
+    if (num_conns == FILTER_MAX_CONNS)
+      port_only = true;
+    else {
+      addrs[num_conns] = conn->ip_addr;
+      ports[num_conns++] = conn->port;
+    }
+  }
+
+  /* Servers still being connected to may answer with something other than a
+     SYN-ACK. */
+  conn = SERVER ? NULL : config->connecting;
+  for (; conn && !port_only; conn = conn->next) {
+    if (num_conns == FILTER_MAX_CONNS)
+      port_only = true;
+    else {
+      addrs[num_conns] = conn->ip_addr;
+      ports[num_conns++] = conn->port;
+    }
+  }
+
+  /* Where the drop and accept instructions are, after the ones checking the
+     port and then the flags and connections. */
+  int drop = port_only ? 5 : 7 + 4 * num_conns;
+  int accept = drop + 1;
+
+  /* Fragments other than the first have no TCP header. Find the TCP header
+     and check the destination port. */
+  prog[n] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6);
+  n++;
+  prog[n] = (struct sock_filter)
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, drop - n - 1, 0);
+  n++;
+  prog[n] = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+  n++;
+  prog[n] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2);
+  n++;
+  prog[n] = (struct sock_filter)
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, config->port,
+             port_only ? accept - n - 1 : 0, drop - n - 1);
+  n++;
+
+  if (!port_only) {
+    /* SYNs and RSTs are handled whoever they are from. */
+    prog[n] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13);
+    n++;
+    prog[n] = (struct sock_filter)
+      BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, TH_SYN | TH_RST, accept - n - 1,
+               0);
+    n++;
+
+    /* Source port and address of each connection. */
+    for (i = 0; i < num_conns; i++) {
+      prog[n] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0);
+      n++;
+      prog[n] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ports[i], 0, 2);
+      n++;
+      prog[n] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12);
+      n++;
+      prog[n] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(addrs[i]), accept - n - 1,
+                 0);
+      n++;
+    }
+  }
+
+  prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+  prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffff);
+
+  struct sock_fprog fprog = { .len = n, .filter = prog };
+  if (setsockopt(config->socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                 sizeof(fprog)) < 0) {
+    if (!filter_attached)
+      fprintf(stderr, "[WARNING] Could not attach socket filter\n");
+    return;
+  }
+  filter_attached = true;
+}
+
 /**
  * Set up the configuration for this host:
- *   - Create raw socket to communicate.
+ *   - Create raw (or UDP) socket to communicate.
  *   - Initialize configuration struct
  *   - Bind to port/name so only relevant packets are received.
  *
@@ -120,6 +545,7 @@ int do_config(char *port) {
   /* Create raw (Unix) socket. */
   int s;
   if (unix_socket)  s = socket(AF_UNIX, SOCK_DGRAM, 0);
+  else if (udp)     s = socket(AF_INET, SOCK_DGRAM, 0);
   else              s = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
   if (s < 0) {
     fprintf(stderr, "[ERROR] Could not open socket (are you running "
@@ -129,13 +555,15 @@ int do_config(char *port) {
 
   /* Make sure kernel knows IP header is included in packet so it doesn't add its
      own. For non-Unix socket only. */
-  if (!unix_socket) {
-    int one = 1;
+  int one = 1;
+  if (!unix_socket && !udp) {
     if (setsockopt(s, IPPROTO_IP, IP_HDRINCL, (char *) &one, sizeof(one)) < 0) {
       fprintf(stderr, "[ERROR] Could not set IP_HDRINCL\n");
       return -1;
     }
 
+  }
+  if (!unix_socket) {
     config->ip_addr = ip_from_self();
     if (config->ip_addr == 0) {
       fprintf(stderr, "[ERROR] Could not determine IP address\n");
@@ -143,6 +571,14 @@ int do_config(char *port) {
     }
   }
 
+  /* Have the kernel split up and join up datagrams, if it can. Setting the
+     segment size to 0 only checks for support; each send sets its own. */
+  if (udp) {
+    int zero = 0;
+    udp_gso = setsockopt(s, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+    udp_gro = setsockopt(s, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+  }
+
   /* Other configuration. */
   config->port = atoi(port);
   config->socket = s;
@@ -169,18 +605,27 @@ int do_config(char *port) {
   }
   else {
     config->saddr.sin_family = AF_INET;
-    config->saddr.sin_addr.s_addr = config->ip_addr;
+    config->saddr.sin_addr.s_addr = udp ? INADDR_ANY : config->ip_addr;
     config->saddr.sin_port = htons(config->port);
 
     addr = (struct sockaddr *) &config->saddr;
     size = sizeof(config->saddr);
   }
 
+  /* Have the kernel drop packets that are not for us. */
+  if (!unix_socket && !udp)
+    filter_update();
+
   if (bind(s, addr, size) < 0) {
     fprintf(stderr, "[ERROR] Could not bind to port %d\n", config->port);
     return -1;
   }
 
+  /* A UDP socket only gets datagrams to its own port, so there is nothing
+     left over from previous connections. */
+  if (udp)
+    return 0;
+
   /* Handle if previous connection(s) have not ended. Send RSTs to those
      hosts in a different thread. First create the reset thread. */
   thread_main = pthread_self();
@@ -199,9 +644,10 @@ int do_config(char *port) {
 
 /**
  * [Client only]
- * Setup the configuration for the server this client is connecting to:
+ * Setup the configuration for a server this client is connecting to:
  *   - Get server host and port.
  *   - Get address of server.
+ * The connection is added to the servers still being connected to.
  *
  * server: Of the form server_host:server_port. The server to connect to.
  *         If no port is specified, defaults to port 80.
@@ -218,19 +664,35 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
   }
   server_port_str = strsep(&server, ":");
   server_port = atoi(server_port_str);
-  config->sconn = calloc(sizeof(conn_t), 1);
-  conn_add(config->sconn);
 
-  /* Get IP address of server. See if this is a server on the same machine. */
+  /* Get IP address of server. See if this is a server on the same machine.
+     Servers on this machine are reached over a Unix socket and others over
+     the network, so the servers can't be a mix of both. */
   in_addr_t dst_ip = ip_from_hostname(_server);
   if (dst_ip == 0)
     return -1;
-  else if (dst_ip != LOCALHOST)
+  if (!udp && config->connecting != NULL &&
+      (dst_ip == LOCALHOST) != unix_socket) {
+    fprintf(stderr, "[ERROR] Servers must all be on this machine or all "
+                    "elsewhere\n");
+    return -1;
+  }
+  if (dst_ip != LOCALHOST)
     unix_socket = false;
 
   /* Set up connection details. */
   int port = server_port == 0 ? DEFAULT_PORT : server_port;
-  conn_setup(config->sconn, dst_ip, port, unix_socket);
+  if (conn_find(config->connecting, dst_ip, port, 0) != NULL) {
+    fprintf(stderr, "[ERROR] Server %s:%d given more than once\n", _server,
+            port);
+    return -1;
+  }
+  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn_setup(conn, dst_ip, port, unix_socket);
+  if (udp)
+    conn->saddr.sin_port = htons(port);
+  conn->next = config->connecting;
+  config->connecting = conn;
 
   return 0;
 }
@@ -268,8 +730,9 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
 }
 
 /**
- * Creates a TCP segment (including the IP header). The returned segment must
- * be freed.
+ * Creates a TCP segment (including the IP header). SYNs and SYN-ACKs carry the
+ * most data this host takes in a segment as an MSS option. The returned
+ * segment must be freed.
  *
  * dst: A conn_t containing details for the destination.
  * flags: TCP flags.
@@ -279,14 +742,24 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
  * returns: A TCP segment with the specified fields.
  */
 char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
-  uint16_t tcp_seg_len = TCP_HDR_SIZE + len;
+  uint16_t opt_len = (flags & TH_SYN) ? TCPOLEN_MAXSEG : 0;
+  uint16_t tcp_seg_len = TCP_HDR_SIZE + opt_len + len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_seg_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
+  uint8_t *opt = (uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+
+  /* MSS option. */
+  if (opt_len > 0) {
+    opt[0] = TCPOPT_MAXSEG;
+    opt[1] = TCPOLEN_MAXSEG;
+    opt[2] = max_seg_size >> 8;
+    opt[3] = max_seg_size & 0xff;
+  }
 
   /* Copy data over, if there is any. */
   if (len > 0 && data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *) opt + opt_len;
     memcpy(payload, data, len);
   }
 
@@ -299,13 +772,14 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(dst->next_seqno);
   tcp_hdr->th_ack = htonl(dst->ackno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opt_len) / 4;
   tcp_hdr->th_flags = flags;
   tcp_hdr->th_win = window;
+  tcp_hdr->th_urp = htons(dst->stripe);
   tcp_hdr->th_sum = 0;
 
-  /* TCP checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, len);
+  /* TCP checksum. Options are summed along with the data. */
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + len);
 
   /* Update sequence numbers. */
   dst->seqno = dst->next_seqno;
@@ -314,9 +788,104 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   return datagram;
 }
 
+/**
+ * Gets a packet buffer from the pool, or allocates one if the pool is empty.
+ *
+ * returns: The buffer.
+ */
+struct seg_buf *seg_buf_get() {
+  struct seg_buf *b = seg_pool;
+  if (b == NULL)
+    return malloc(sizeof(struct seg_buf) + max_packet_size);
+
+  seg_pool = b->next;
+  seg_pool_len--;
+  return b;
+}
+
+/**
+ * Returns a packet buffer to the pool, or frees it if the pool is full.
+ *
+ * b: The buffer.
+ */
+void seg_buf_put(struct seg_buf *b) {
+  if (seg_pool_len >= seg_pool_max) {
+    free(b);
+    return;
+  }
+  b->next = seg_pool;
+  seg_pool = b;
+  seg_pool_len++;
+}
+
+/**
+ * Allocates a zeroed cTCP segment in a packet buffer. It must be freed with
+ * segment_free().
+ *
+ * len: Length of the segment (including the cTCP header and data). At most
+ *      max_packet_size - SEG_OFFSET.
+ * returns: The segment.
+ */
+ctcp_segment_t *segment_alloc(size_t len) {
+  ctcp_segment_t *segment = (ctcp_segment_t *) (seg_buf_get()->pkt +
+                                                SEG_OFFSET);
+  memset(segment, 0, len);
+  return segment;
+}
+
+void segment_free(ctcp_segment_t *segment) {
+  if (segment == NULL)
+    return;
+  seg_buf_put((struct seg_buf *) ((char *) segment - SEG_OFFSET -
+                                  offsetof(struct seg_buf, pkt)));
+}
+
+/**
+ * Rewrites the headers of a raw IP packet into a cTCP segment, in place. The
+ * segment ends where the packet's data starts, so the data stays where it is.
+ * If there is padding, keep it.
+ *
+ * src: A conn_t containing connection details of the segment's sender.
+ * datagram: The raw IP packet, in the pkt of a packet buffer.
+ * returns: The cTCP segment, inside the packet buffer. The buffer now belongs
+ *          to the segment, which is freed with segment_free().
+ */
+ctcp_segment_t *convert_to_ctcp_in_place(conn_t *src, char *datagram) {
+  iphdr_t *ip_hdr = (iphdr_t *) datagram;
+  tcphdr_t tcp_hdr;
+  memcpy(&tcp_hdr, datagram + IP_HDR_SIZE, TCP_HDR_SIZE);
+
+  /* Sum the data where it is. The TCP header is needed for its checksum
+     before it is overwritten. */
+  uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
+  uint16_t len = data_len + sizeof(ctcp_segment_t);
+  uint32_t data_sum = cksum_add(0, datagram + FULL_HDR_SIZE, data_len);
+  uint16_t sum = tcp_hdr.th_sum;
+  ((tcphdr_t *) (datagram + IP_HDR_SIZE))->th_sum = 0;
+  uint16_t correct_sum = cksum_fold(cksum_tcp_hdrs(ip_hdr, data_len) +
+                                    data_sum);
+
+  /* Set fields of cTCP segment. Convert sequence numbers to relative
+     sequence numbers. */
+  ctcp_segment_t *segment = (ctcp_segment_t *) (datagram + SEG_OFFSET);
+  memset(segment, 0, sizeof(ctcp_segment_t));
+  segment->seqno = htonl(ntohl(tcp_hdr.th_seq) - src->their_init_seqno);
+  segment->ackno = htonl(ntohl(tcp_hdr.th_ack) - src->init_seqno);
+  segment->len = htons(len);
+  segment->flags = tcp_hdr.th_flags;
+  segment->window = tcp_hdr.th_win;
+  segment->cksum = cksum_fold(cksum_add(data_sum, segment,
+                                        sizeof(ctcp_segment_t)));
+
+  /* Same translation back to the student's cTCP checksum as in
+     convert_to_ctcp(). */
+  segment->cksum += (correct_sum - sum);
+  return segment;
+}
+
 /**
  * Converts a packet from a raw IP packet to a cTCP segment. If there is
- * padding, keep it. The resulting segment must be freed.
+ * padding, keep it. The resulting segment must be freed with segment_free().
  *
  * src: A conn_t containing connection details of the segment's sender.
  * datagram: The raw IP packet.
@@ -331,7 +900,7 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   /* Get actual lengths and allocate cTCP segment of correct size. */
   uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
   uint16_t len = data_len + sizeof(ctcp_segment_t);
-  ctcp_segment_t *segment = calloc(len, 1);
+  ctcp_segment_t *segment = segment_alloc(len);
 
   /* Set fields of cTCP segment. Convert sequence numbers to relative
      sequence numbers. */
@@ -357,29 +926,32 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
 }
 
 /**
- * Converts a segment from a cTCP segment to a raw IP packet. The resulting
- * packet must be freed.
+ * Builds a raw IP packet from a cTCP segment in a buffer. The IP and TCP
+ * headers are written into the first FULL_HDR_SIZE bytes and the data is
+ * copied in after them, unless it is there already. Checksums are summed
+ * over the data where it is, once for both the cTCP and the TCP checksum.
  *
  * dst: A conn_t containing connection details of the packet's receiver.
  * segment: The cTCP segment.
  * len: Length of the cTCP segment (including the headers).
- * returns: A raw IP packet, NULL if it has an incorrect checksum.
+ * datagram: Buffer for the packet. Must be at least FULL_HDR_SIZE plus the
+ *           data length long.
  */
-char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
-  /* Create IP packet with TCP payload. */
-  uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + TCP_HDR_SIZE;
-  char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_pkt_len);
+void fill_datagram(conn_t *dst, ctcp_segment_t *segment, int len,
+                   char *datagram) {
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+  uint16_t tcp_pkt_len = data_len + TCP_HDR_SIZE;
+  fill_ip_hdr(datagram, config->ip_addr, dst->ip_addr, tcp_pkt_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
+  char *payload = datagram + FULL_HDR_SIZE;
 
   /* Copy data over, if there is any. */
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
-  if (data_len > 0 && segment->data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+  if (data_len > 0 && payload != segment->data)
     memcpy(payload, segment->data, data_len);
-  }
 
   /* TCP header. Convert relative sequence numbers to sequence numbers. */
+  memset(tcp_hdr, 0, TCP_HDR_SIZE);
   tcp_hdr->th_sport = htons(config->port);
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(ntohl(segment->seqno) + dst->init_seqno);
@@ -391,47 +963,70 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   if (!run_program && !unix_socket)
     tcp_hdr->th_flags |= TH_ACK;
   tcp_hdr->th_win = segment->window;
+  tcp_hdr->th_urp = htons(dst->stripe);
   tcp_hdr->th_sum = 0;
 
   /* Add on the difference between the student's checksum and the correct
      checksum. If the difference is 0, then they computed the checksum
      correctly. Otherwise, an incorrect cTCP checksum will result in an
      incorrect TCP checksum. */
+  uint32_t data_sum = cksum_add(0, payload, data_len);
+  ctcp_segment_t hdr;
+  memcpy(&hdr, segment, sizeof(ctcp_segment_t));
+  hdr.cksum = 0;
   uint16_t sum = segment->cksum;
-  segment->cksum = 0;
-  uint16_t correct_sum = cksum(segment, len);
-  segment->cksum = sum;
+  uint16_t correct_sum =
+    cksum_fold(cksum_add(data_sum, &hdr, sizeof(ctcp_segment_t)));
   /* TCP checksum. Add on the difference between the correct checksum and the
      student's checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, data_len);
+  tcp_hdr->th_sum = cksum_fold(cksum_tcp_hdrs(ip_hdr, data_len) + data_sum);
   tcp_hdr->th_sum += (correct_sum - sum);
+}
+
+/**
+ * Converts a segment from a cTCP segment to a raw IP packet. The resulting
+ * packet must be freed.
+ *
+ * dst: A conn_t containing connection details of the packet's receiver.
+ * segment: The cTCP segment.
+ * len: Length of the cTCP segment (including the headers).
+ * returns: A raw IP packet, NULL if it has an incorrect checksum.
+ */
+char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
+  char *datagram = malloc(len - sizeof(ctcp_segment_t) + FULL_HDR_SIZE);
+  fill_datagram(dst, segment, len, datagram);
   return datagram;
 }
 
 /**
- * Naive filtering. Host might receive many unwanted packets or leftover
- * packets from a previous session. We drop these packets.
+ * Naive filtering of a packet that has already been received. Host might
+ * receive many unwanted packets or leftover packets from a previous session.
+ * We drop these packets.
  *
- * sockfd: Socket file descriptor.
- * buf: Buffer to receive data into.
- * len: Length of buffer and maximum size of data to receive.
- * flags: Flags for recv.
+ * buf: Buffer containing the packet. Must be max_packet_size bytes long.
+ * r: Number of bytes actually received.
  * rconn: Return parameter. Pointer to the connection state associated with
  *        the sender of the packet.
  *
- * returns: Length of packet if packet wasn't dropped, 0 if no packet
- *          received, and -1 on failure.
+ * returns: Length of packet if packet wasn't dropped, 0 otherwise.
  */
-int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
-  int r = recv(sockfd, buf, len, flags);
-  if (r < 0)
-    return -1;
-
+int filter_pkt(void *buf, int r, conn_t **rconn) {
   if (r < FULL_HDR_SIZE)
     return 0;
 
-  /* Is this packet to us? If not, ignore it. */
+  /* Receive buffers are reused without being cleared. Zero out whatever the
+     IP header claims is there beyond what was actually received. Drop packets
+     that claim to be shorter than their own headers. */
   iphdr_t *ip_hdr = (iphdr_t *) buf;
+  int tot_len = ntohs(ip_hdr->tot_len);
+  if (tot_len < FULL_HDR_SIZE)
+    return 0;
+  if (tot_len > (int) max_packet_size)
+    tot_len = max_packet_size;
+  if (tot_len > r)
+    memset(buf + r, 0, tot_len - r);
+
+  /* Is this packet to us? If not, ignore it. */
   tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
   if (tcp_hdr->th_dport != htons(config->port))
     return 0;
@@ -451,8 +1046,9 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
      number we expect. */
   conn_t *conn = get_connections();
   while (conn != NULL) {
-    if (conn->port == ntohs(tcp_hdr->th_sport) &&
+    if (!conn->delete_me && conn->port == ntohs(tcp_hdr->th_sport) &&
         (unix_socket || (!unix_socket && conn->ip_addr == ip_hdr->saddr)) &&
+        conn->stripe == ntohs(tcp_hdr->th_urp) &&
         ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
         ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
       /* Return associated connection. */
@@ -464,9 +1060,35 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
     conn = conn->next;
   }
 
+  /* An answer from a server still being connected to. */
+  if (!SERVER && conn_find(config->connecting, ip_hdr->saddr,
+                           ntohs(tcp_hdr->th_sport),
+                           ntohs(tcp_hdr->th_urp)) != NULL)
+    return r;
+
   return 0;
 }
 
+/**
+ * Receives a single packet and filters it (see filter_pkt()).
+ *
+ * sockfd: Socket file descriptor.
+ * buf: Buffer to receive data into.
+ * len: Length of buffer and maximum size of data to receive.
+ * flags: Flags for recv.
+ * rconn: Return parameter. Pointer to the connection state associated with
+ *        the sender of the packet.
+ *
+ * returns: Length of packet if packet wasn't dropped, 0 if no packet
+ *          received, and -1 on failure.
+ */
+int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
+  int r = recv(sockfd, buf, len, flags);
+  if (r < 0)
+    return -1;
+  return filter_pkt(buf, r, rconn);
+}
+
 /**
  * Sends a packet out through the appropriate socket.
  *
@@ -495,6 +1117,142 @@ int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
   return sendto(config->socket, buf, len, flags, addr, size);
 }
 
+/**
+ * Allocates the transmit queue used by queue_pkt() and send_flush().
+ */
+void send_batch_init() {
+  int i;
+  send_msgs = calloc(send_batch, sizeof(struct mmsghdr));
+  send_iovs = calloc(send_batch, sizeof(struct iovec));
+  send_addrs = calloc(send_batch, sizeof(*send_addrs));
+  send_bufs = malloc(send_batch * max_packet_size);
+  send_dsts = calloc(send_batch, sizeof(conn_t *));
+  send_cmsgs = calloc(send_batch, sizeof(*send_cmsgs));
+
+  for (i = 0; i < send_batch; i++) {
+    send_iovs[i].iov_base = send_bufs + i * max_packet_size;
+    send_msgs[i].msg_hdr.msg_name = &send_addrs[i];
+  }
+}
+
+/**
+ * Sends everything in the transmit queue with as few sendmmsg() calls as
+ * possible, then empties it. A message that fails to send is dropped, just as
+ * a failed sendto() would have dropped it, and the ones after it are still
+ * sent. If the socket buffer is full, the rest stay queued for the next call,
+ * unless the queue has no room left, in which case they are dropped too.
+ */
+void send_flush() {
+  int n;
+
+  while (send_head < send_nmsgs) {
+    n = sendmmsg(config->socket, send_msgs + send_head,
+                 send_nmsgs - send_head, MSG_DONTWAIT);
+    if (n > 0) {
+      send_head += n;
+      continue;
+    }
+    if (n == 0)
+      break;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      if (send_queued == send_batch)
+        break;
+      /* Its destination may be gone by the next call. Don't add to it. */
+      send_dsts[send_nmsgs - 1] = NULL;
+      return;
+    }
+
+    /* Some devices cannot do UDP GSO. Stop using it. */
+    if ((errno == EIO || errno == EINVAL) && udp_gso) {
+      fprintf(stderr, "[INFO] UDP GSO not available\n");
+      udp_gso = false;
+    }
+    send_head++;
+  }
+
+  send_queued = 0;
+  send_nmsgs = 0;
+  send_head = 0;
+}
+
+/**
+ * Returns the transmit queue slot the next datagram is to be built in. It is
+ * max_packet_size bytes long.
+ */
+char *send_slot() {
+  return send_iovs[send_queued].iov_base;
+}
+
+/**
+ * [UDP only]
+ * Adds a datagram to the message before it in the transmit queue, if that
+ * message's datagrams all have the same size and this one is no longer. The
+ * kernel splits the message up at that size (GSO), so only the last datagram
+ * in it may be shorter.
+ *
+ * hdr: The message before it. Its datagrams end right before this one.
+ * cmsg_buf: Room for the message's UDP_SEGMENT control message.
+ * len: Length of the datagram.
+ * returns: true if the datagram was added to the message.
+ */
+bool gso_join(struct msghdr *hdr, char *cmsg_buf, size_t len) {
+  size_t size = hdr->msg_iov[0].iov_len;
+  if (len > size || hdr->msg_iov[hdr->msg_iovlen - 1].iov_len != size ||
+      hdr->msg_iovlen == GSO_MAX_SEGS ||
+      (hdr->msg_iovlen + 1) * size > GSO_MAX_BYTES)
+    return false;
+
+  struct cmsghdr *cmsg = (struct cmsghdr *) cmsg_buf;
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  *(uint16_t *) CMSG_DATA(cmsg) = size;
+  hdr->msg_control = cmsg;
+  hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+  hdr->msg_iovlen++;
+  return true;
+}
+
+/**
+ * Adds the datagram built in send_slot() to the transmit queue. The queue is
+ * flushed if it becomes full.
+ *
+ * dst: Destination connection object.
+ * len: Length of the datagram.
+ *
+ * returns: Number of bytes queued.
+ */
+int queue_pkt(conn_t *dst, size_t len) {
+  struct iovec *iov = &send_iovs[send_queued];
+  iov->iov_len = len;
+
+  /* A message of its own, unless it can be sent along with the previous
+     datagrams to the same destination. */
+  int m = send_nmsgs - 1;
+  if (!udp_gso || m < 0 || send_dsts[m] != dst ||
+      !gso_join(&send_msgs[m].msg_hdr, send_cmsgs[m], len)) {
+    struct msghdr *hdr = &send_msgs[send_nmsgs].msg_hdr;
+    if (unix_socket) {
+      memcpy(&send_addrs[send_nmsgs].un, &dst->sunaddr, sizeof(dst->sunaddr));
+      hdr->msg_namelen = sizeof(dst->sunaddr);
+    }
+    else {
+      memcpy(&send_addrs[send_nmsgs].in, &dst->saddr, sizeof(dst->saddr));
+      hdr->msg_namelen = sizeof(dst->saddr);
+    }
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = NULL;
+    hdr->msg_controllen = 0;
+    send_dsts[send_nmsgs++] = dst;
+  }
+
+  if (++send_queued == send_batch)
+    send_flush();
+  return len;
+}
+
 /**
  * Send resets to previous connections, if they exist. We can tell if there are
  * lots of RSTs or ACKs being sent to us.
@@ -548,7 +1306,8 @@ void *send_resets(void *args) {
  */
 int send_tcp_conn_seg(conn_t *dst, int flags) {
   char *tcp_pkt = create_tcp_seg(dst, flags, NULL, 0);
-  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE, 0);
+  int r = send_pkt(dst, config->socket, tcp_pkt,
+                   ntohs(((iphdr_t *) tcp_pkt)->tot_len), 0);
   free(tcp_pkt);
 
   if (r < 0) {
@@ -573,6 +1332,19 @@ inline int send_synack(conn_t *dst) {
 
 ////////////////////// CONNECTIONS AND SENDING/RECEIVING //////////////////////
 
+/**
+ * Allocates an output buffer. Output buffers are mapped rather than malloc'ed
+ * so that pages spliced into a pipe are never handed out again while the pipe
+ * still refers to them, even once the buffer is freed.
+ *
+ * size: Size of the buffer.
+ * returns: The buffer.
+ */
+char *out_buf_alloc(size_t size) {
+  return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+}
+
 /**
  * Add to the conn_t list.
  *
@@ -589,481 +1361,2896 @@ void conn_add(conn_t *conn) {
     if (conn_list)
       conn_list->prev = &conn->next;
   }
-  conn->out_queue_tail = &conn->out_queue;
-
-  if (SERVER)
+  conn->out_buf = out_buf_alloc(out_buf_size);
+  conn->out_cap = out_buf_size;
+  conn->in_buf = malloc(IN_BUF_SPACE);
+  conn->in_data = conn->in_buf;
+
+  if (worker)
+    worker->connections = conn;
+  else if (SERVER)
     config->connections = conn;
   else
     config->sconn = conn;
+
+  if (filter_attached)
+    filter_update();
 }
 
 /**
- * Checks how much space is available in STDOUT for output. conn_output can
- * only write as many bytes as reported by conn_bufspace.
+ * Describes the bytes in the output buffer that still need to be outputted,
+ * which may wrap around the end of the buffer.
  *
- * conn: The connection object.
- * returns: The number of bytes that can be written out.
+ * conn: Associated connection object.
+ * iov: Array of two iovecs to fill in.
+ * returns: The number of iovecs used.
  */
-size_t conn_bufspace(conn_t *conn) {
-  chunk_t *chunk;
-  size_t used = 0;
+int out_buf_iov(conn_t *conn, struct iovec *iov) {
+  size_t start = (conn->out_head + conn->out_pipe) % conn->out_cap;
+  size_t len = conn->out_len - conn->out_pipe;
+  size_t first = conn->out_cap - start;
+  if (len == 0)
+    return 0;
 
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
-    used += (chunk->size - chunk->used);
+  iov[0].iov_base = conn->out_buf + start;
+  if (len <= first) {
+    iov[0].iov_len = len;
+    return 1;
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
+  iov[0].iov_len = first;
+  iov[1].iov_base = conn->out_buf;
+  iov[1].iov_len = len - first;
+  return 2;
 }
 
 /**
- * Drain the output queue.
+ * Removes bytes from the start of the output buffer once they are no longer
+ * needed.
  *
  * conn: Associated connection object.
+ * w: Number of bytes to remove.
  */
-void conn_drain(conn_t *conn) {
-  chunk_t *chunk;
-  int w;
-  bool outputted = false;
-  events[STDOUT_FILENO].events &= ~POLLOUT;
-
-  /* Already wrote an error, can't write anymore. */
-  if (conn->wrote_err)
-    return;
-
-  /* Drain the output queue. Output as many chunks as possible. */
-  while ((chunk = conn->out_queue)) {
-    if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-    else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-
-    if (w < 0) {
-      if (errno != EAGAIN)
-        conn->wrote_err = true;
-      break;
-    }
-    outputted = true;
-    chunk->used += w;
-
-    /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
-      break;
-    }
-    conn->out_queue = chunk->next;
-
-    /* Update pointers. */
-    if (!conn->out_queue)
-      conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
-  }
-
-  /* Error in outputting if already wrote EOF but still stuff in the output
-     queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
-    conn->wrote_err = true;
-
-  /* Output queue has space. Call student code. */
-  if (outputted && !conn->delete_me)
-    ctcp_output(conn->state);
+void out_buf_advance(conn_t *conn, size_t w) {
+  conn->out_head = (conn->out_head + w) % conn->out_cap;
+  conn->out_len -= w;
+  if (conn->out_len == 0)
+    conn->out_head = 0;
 }
 
 /**
- * Removes a connection object from the conn_t list.
+ * Grows the output buffer, copying its contents to the start of the new
+ * buffer.
  *
- * conn: The conn_t to free.
+ * conn: Associated connection object.
+ * cap: New capacity.
  */
-void conn_free(conn_t *conn) {
-  /* Free up chunks. */
-  chunk_t *chunk, *next_chunk;
-  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
-    next_chunk = chunk->next;
-    free(chunk);
+void out_buf_grow(conn_t *conn, size_t cap) {
+  struct iovec iov[2];
+  int i, n = out_buf_iov(conn, iov);
+  size_t off = 0;
+
+  char *out_buf = out_buf_alloc(cap);
+  for (i = 0; i < n; i++) {
+    memcpy(out_buf + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
   }
+  munmap(conn->out_buf, conn->out_cap);
+  conn->out_buf = out_buf;
+  conn->out_cap = cap;
+  conn->out_head = 0;
+}
 
-  /* Adjust pointers. */
-  if (conn->next)
-    conn->next->prev = conn->prev;
-  if (conn->prev)
-    *conn->prev = conn->next;
-
-  if (conn == get_connections()) {
-    if (SERVER)
-      config->connections = NULL;
-    else
-      config->sconn = NULL;
+/**
+ * Appends data to the output buffer, growing the buffer first if needed. The
+ * caller must make sure there is enough space (see conn_bufspace()).
+ *
+ * conn: Associated connection object.
+ * buf: Data to append.
+ * len: Length of the data.
+ */
+void out_buf_append(conn_t *conn, const char *buf, size_t len) {
+  /* Grow by doubling. */
+  if (conn->out_len + len > conn->out_cap) {
+    size_t cap = conn->out_cap;
+    while (cap < conn->out_len + len)
+      cap *= 2;
+    out_buf_grow(conn, cap > out_buf_max ? out_buf_max : cap);
   }
 
-  /* Close pipes to program, if it's running. */
-  if (run_program) {
-    close(conn->stdin);
-    close(conn->stdout);
+  /* Copy into the free space after the contents, wrapping around. */
+  size_t tail = (conn->out_head + conn->out_len) % conn->out_cap;
+  size_t first = conn->out_cap - tail;
+  if (len <= first) {
+    memcpy(conn->out_buf + tail, buf, len);
   }
-  free(conn);
+  else {
+    memcpy(conn->out_buf + tail, buf, first);
+    memcpy(conn->out_buf, buf + first, len - first);
+  }
+  conn->out_len += len;
 }
 
 /**
- * Reads input that then needs to be put into segments to send off. Reads up to
- * to len bytes.
+ * Sets up splicing into a pipe by enlarging it. An output buffer has to be at
+ * least as large as the pipe, or a pipe with room left could end up holding
+ * on to the entire buffer. Output buffers are made large enough for a pipe of
+ * SPLICE_PIPE_SIZE at startup, so this can be called from worker threads.
  *
- * conn: The connection object.
- * buf: Buffer to read
- * len: Maximum number of bytes to read.
- * returns: -1 if error or EOF, otherwise the actual number of bytes read. If
- *          no data is available, returns 0. The library will call ctcp_read
- *          again once data is available from conn_input.
+ * fd: File descriptor that output goes to.
+ * returns: Whether or not output to fd can be spliced.
  */
-int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
-  int r;
+bool splice_setup(int fd) {
+  struct stat st;
+  if (!opt_splice || fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode))
+    return false;
+
+  fcntl(fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+  int size = fcntl(fd, F_GETPIPE_SZ);
+  return size >= 0 && (size_t) size <= out_buf_size;
+}
 
-  /* Check parameters. */
-  if (conn == NULL || buf == NULL) {
-    fprintf(stderr, "[ERROR] NULL parameters in conn_input\n");
-    return -1;
-  }
+/**
+ * Returns the pipe that a connection's output is spliced into.
+ *
+ * conn: Associated connection object.
+ */
+struct splice_pipe *splice_pipe_of(conn_t *conn) {
+  return run_program ? &conn->prog_pipe : &stdout_pipe;
+}
 
-  /* Already read EOF. */
-  if (conn->read_eof) {
-    return -1;
+/**
+ * Splices the unspliced part of the output buffer into a pipe, and notes where
+ * in the pipe its bytes went.
+ *
+ * conn: Associated connection object.
+ * iov: Unspliced part of the output buffer.
+ * iovcnt: Number of entries in iov.
+ * returns: Number of bytes spliced, or -1 on failure.
+ */
+int splice_out(conn_t *conn, struct iovec *iov, int iovcnt) {
+  struct splice_pipe *pipe = splice_pipe_of(conn);
+  pthread_mutex_lock(&pipe->lock);
+  int w = vmsplice(pipe->fd, iov, iovcnt, SPLICE_F_NONBLOCK);
+  if (w <= 0) {
+    pthread_mutex_unlock(&pipe->lock);
+    return w;
   }
-
-  /* Read from the appropriate place (STOUT of the associated program). */
-  if (run_program)
-    r = read(conn->stdout, buf, len);
-  else if (unix_socket)
-    r = read(STDIN_FILENO, buf, len);
-  /* Add network-line endings if needed. */
-  else {
-    r = read(STDIN_FILENO, buf, len - 1);
-    if (r > 0) {
-      if (add_network_line_ending(!unix_socket, buf, r))
-        r += 1;
-      else
-        r += read(STDIN_FILENO, buf + r, 1);
-    }
+  uint64_t start = pipe->written;
+  pipe->written += w;
+  pthread_mutex_unlock(&pipe->lock);
+
+  /* Right after the last bytes from this connection. Make them longer. */
+  int last = conn->num_splices - 1;
+  if (last >= conn->splices_first &&
+      conn->splices[last].start + conn->splices[last].len == start) {
+    conn->splices[last].len += w;
+    return w;
   }
 
-  /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
-  if (r == 0 || (r < 0 && errno != EAGAIN) ||
-      ((test_debug_on || lab5_mode) && r > 0 && ((char *) buf)[0] == 0x1a)) {
-    conn->read_eof = true;
-    return -1;
-  }
-  /* No input. */
-  else if (r < 0 && errno == EAGAIN) {
-    r = 0;
+  if (conn->num_splices == conn->splices_cap) {
+    if (conn->splices_first > 0) {
+      conn->num_splices -= conn->splices_first;
+      memmove(conn->splices, conn->splices + conn->splices_first,
+              conn->num_splices * sizeof(struct splice_rec));
+      conn->splices_first = 0;
+    }
+    else {
+      conn->splices_cap = conn->splices_cap ? 2 * conn->splices_cap : 8;
+      conn->splices = realloc(conn->splices,
+                              conn->splices_cap * sizeof(struct splice_rec));
+    }
   }
-
-  return r;
+  conn->splices[conn->num_splices].start = start;
+  conn->splices[conn->num_splices].len = w;
+  conn->num_splices++;
+  return w;
 }
 
 /**
- * Schedules a connection object for removal.
+ * Frees up spliced bytes in the output buffer that the other end of the pipe
+ * has read. Other connections may splice into the same pipe, so how many of
+ * this connection's bytes have been read comes from how many bytes have been
+ * read out of the pipe in all.
  *
- * conn: The conn_t to remove.
+ * conn: Associated connection object.
  */
-void conn_remove(conn_t *conn) {
-  conn->delete_me = true;
+void splice_reclaim(conn_t *conn) {
+  struct splice_pipe *pipe = splice_pipe_of(conn);
+  int unread;
 
-  /* Log to tester that this connection has been removed (as a result to a call
-     to ctcp_destroy). */
-  if (test_debug_on) {
-    fprintf(stderr, DEBUG_TEARDOWN);
+  pthread_mutex_lock(&pipe->lock);
+  int r = ioctl(pipe->fd, FIONREAD, &unread);
+  uint64_t read = pipe->written - unread;
+  pthread_mutex_unlock(&pipe->lock);
+
+  /* If the amount is unknown, keep holding on to the bytes. */
+  if (r < 0)
+    return;
+
+  size_t done = 0;
+  while (conn->splices_first < conn->num_splices) {
+    struct splice_rec *rec = &conn->splices[conn->splices_first];
+    if (read <= rec->start)
+      break;
+    if (read - rec->start < rec->len) {
+      size_t n = read - rec->start;
+      rec->start += n;
+      rec->len -= n;
+      done += n;
+      break;
+    }
+    done += rec->len;
+    conn->splices_first++;
   }
+  if (conn->splices_first == conn->num_splices)
+    conn->splices_first = conn->num_splices = 0;
+
+  conn->out_pipe -= done;
+  out_buf_advance(conn, done);
 }
 
 /**
- * Sends a cTCP segment to a destination associated with the provided
- * connection object.
+ * Checks how much space is available in STDOUT for output. conn_write can
+ * only write as many bytes as reported by out_buf_space.
  *
- * conn: Connection object.
- * segment: Pointer to cTCP segment to send.
- * len: Length of the segment (including the cTCP header and data).
- *
- * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
- *          there in an error.
+ * conn: The connection object.
+ * returns: The number of bytes that can be written out.
  */
-int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
-  /* Check parameters. */
-  if (conn == NULL || segment == NULL) {
-    fprintf(stderr, "[ERROR] NULL parameters in conn_send\n");
-    return -1;
+size_t out_buf_space(conn_t *conn) {
+  /* Output goes to the output thread. Remember to let student code know once
+     there is more space. */
+  if (pipeline) {
+    size_t space = out_ring_space();
+    if (space < max_seg_size)
+      conn->out_blocked = true;
+    return space;
   }
 
-  /* Make a copy of the segment first. */
-  ctcp_segment_t *segment_copy = calloc(len, 1);
-  memcpy(segment_copy, segment, len);
+  /* Spliced bytes that have been read since can be reused. */
+  if (conn->out_pipe > 0)
+    splice_reclaim(conn);
 
-  /* Fork process off in order to do unreliability. Keep track of whether we
-     are forked or not. */
-  int fork_level = 0;
-  bool am_i_forked = 0;
+  /* The buffer can't be moved while io_uring is writing out of it or a pipe
+     still refers to it. */
+  size_t cap = conn->out_cap;
+  if (out_buf_max > cap && !conn->uring_writing && conn->out_pipe == 0)
+    cap = out_buf_max;
+  return cap - conn->out_len;
+}
 
-  /* Segment drop. Don't send the segment. */
-  if ((test_debug_on && !tester_did_unreliable && opt_drop) ||
-      (!test_debug_on && rand_percent(fork_level) < opt_drop)) {
-    tester_did_unreliable = true;
+/**
+ * Checks how much space is available in STDOUT for output. conn_output can
+ * only write as many bytes as reported by conn_bufspace. A stripe of a client
+ * can take as much as stripes_space() says.
+ *
+ * conn: The connection object.
+ * returns: The number of bytes that can be written out.
+ */
+size_t conn_bufspace(conn_t *conn) {
+  if (conn->stripes)
+    return stripes_space(conn);
+  return out_buf_space(conn);
+}
 
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Dropping segment\n");
-      print_hdr_ctcp(segment_copy);
-    }
-    free(segment_copy);
-    return len;
-  }
+/**
+ * Writes out as much of the output buffer as possible. With the io_uring
+ * backend, this only submits a write.
+ *
+ * When splicing, the pages of the output buffer are passed to the pipe with
+ * vmsplice() instead of being copied. The spliced bytes stay in the output
+ * buffer until they have been read.
+ *
+ * conn: Associated connection object.
+ * returns: Whether or not any space in the output buffer was freed up, or
+ *          more output could be passed on.
+ */
+bool out_buf_flush(conn_t *conn) {
+  struct iovec iov[2];
+  int w;
+  bool outputted = false;
+  bool splice = run_program ? conn->out_splice : stdout_splice;
+  int fd = run_program ? conn->stdin : STDOUT_FILENO;
 
-  /* Segment duplication. Fork another process to send the other segment. */
-  if ((test_debug_on && !tester_did_unreliable && opt_duplicate) ||
-      (!test_debug_on && rand_percent(fork_level) < opt_duplicate)) {
-    tester_did_unreliable = true;
+  if (splice && conn->out_pipe > 0) {
+    size_t pipe = conn->out_pipe;
+    splice_reclaim(conn);
+    outputted = conn->out_pipe < pipe;
+  }
 
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Duplicating segment\n");
-      print_hdr_ctcp(segment_copy);
-    }
-    if (fork() == 0) {
-      am_i_forked = 1;
-      fork_level++;
-    }
+  if (use_uring && !splice) {
+    if (conn->out_len > 0 && !conn->uring_writing)
+      uring_write(conn);
+    return false;
   }
 
-  /* Segment delay. Fork another process to delay the segment, and kill the
-     current one. */
-  if ((test_debug_on && !tester_did_unreliable && opt_delay) ||
-       (!test_debug_on && rand_percent(fork_level) < opt_delay)) {
-    tester_did_unreliable = true;
+  /* Drain the output buffer. Everything is written out with one call, even if
+     the contents wrap around the end of the buffer. */
+  if (conn->out_len > conn->out_pipe) {
+    int iovcnt = out_buf_iov(conn, iov);
+    if (splice)
+      w = splice_out(conn, iov, iovcnt);
+    else
+      w = writev(fd, iov, iovcnt);
 
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Delaying segment\n");
-      print_hdr_ctcp(segment_copy);
+    if (w < 0) {
+      if (errno != EAGAIN)
+        conn->wrote_err = true;
     }
-    /* Forked process. Sleep for a bit. */
-    if (fork() == 0) {
-      am_i_forked = 1;
-      fork_level++;
-      sleep(rand() % 5);
+    else if (splice) {
+      outputted = true;
+      conn->out_pipe += w;
     }
-    /* Original process. */
     else {
-      free(segment_copy);
-      return len;
+      outputted = true;
+      out_buf_advance(conn, w);
     }
-  }
 
-  /* Segment corruption. Flip bits in the segment after the TCP flags (to avoid
-     corrupting the flags, which may cause problems). */
-  bool do_corrupt = rand_percent(fork_level) < opt_corrupt;
-  uint16_t data_length = len - sizeof(ctcp_segment_t) + sizeof(uint32_t);
-  uint16_t rand_bit = rand() % (data_length * 8 - 1) +
-                      (sizeof(ctcp_segment_t) - sizeof(uint32_t)) * 8;
+    /* Could not write out everything. Wait until there is room. */
+    if (conn->out_len > conn->out_pipe && !conn->wrote_err) {
+      if (use_uring)
+        uring_poll_writable(conn);
+      else
+        events[STDOUT_FILENO].events |= POLLOUT;
+    }
+  }
+  return outputted;
+}
 
-  if ((test_debug_on && !tester_did_unreliable && opt_corrupt) ||
-      (!test_debug_on && do_corrupt)) {
-    tester_did_unreliable = true;
+/**
+ * Drain the output buffer. With the io_uring backend, this only submits a
+ * write; the rest is done once the write completes.
+ *
+ * conn: Associated connection object.
+ */
+void conn_drain(conn_t *conn) {
+  bool outputted;
 
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Corrupting segment\n");
-      print_hdr_ctcp(segment_copy);
+  /* The output thread made space. Call student code if it was short. */
+  if (pipeline) {
+    if (conn->out_blocked && !conn->delete_me) {
+      conn->out_blocked = false;
+      ctcp_output(conn->state);
     }
-    flipbit(segment_copy, rand_bit);
   }
+  else {
+    events[STDOUT_FILENO].events &= ~POLLOUT;
 
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
-  uint16_t total_len = FULL_HDR_SIZE + data_len;
+    /* Already wrote an error, can't write anymore. */
+    if (conn->wrote_err)
+      return;
+    outputted = out_buf_flush(conn);
 
-  if (log_file != -1 || test_debug_on) {
-    log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
-                len, true, unix_socket);
-  }
+    /* Error in outputting if already wrote EOF but still stuff in the output
+       queue. */
+    if (conn->wrote_eof && !conn->wrote_err && conn->out_len == conn->out_pipe)
+      conn->wrote_err = true;
 
-  /* Convert from a cTCP segment to a real one and finally send the segment. */
-  char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
-  if (DEBUG) {
-    fprintf(stderr, "[DEBUG] Sent segment\n");
-    print_hdr_ctcp(segment_copy);
+    /* Output queue has space. Call student code. */
+    if (outputted && !conn->delete_me)
+      ctcp_output(conn->state);
   }
-  free(pkt);
-  free(segment_copy);
 
-  /* Kill forked process. */
-  if (am_i_forked)
-    exit(0);
+  /* Output of a striped client goes through this connection. Put out more of
+     its chunks. */
+  if (conn->stripes && conn->stripes->out == conn)
+    stripes_flush(conn->stripes);
+}
 
-  /* Return number of bytes sent. Need to subtract some because the return value
-     is actually the size of the TCP segment instead of the cTCP segment. */
-  if (n >= (long int)TCP_HDR_SIZE)
-    return n - (TCP_HDR_SIZE + IP_HDR_SIZE - sizeof(ctcp_segment_t));
-  return n;
+/**
+ * Checks on spliced output that has not been read yet. Called on every timer
+ * tick, since nothing else signals that the other end has read from a pipe
+ * that was never full. Student code is only called if output was held up.
+ */
+void splice_timer() {
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->out_pipe == 0 || conn->delete_me)
+      continue;
+
+    if (conn->out_len > conn->out_pipe ||
+        conn->out_cap - conn->out_len < max_seg_size)
+      conn_drain(conn);
+    else
+      splice_reclaim(conn);
+  }
 }
 
 /**
- * Writes a buffer to STDOUT or the program associated with this connection.
- * If called with a length of 0, an EOF is recorded.
+ * [Loopback mode only]
+ * Passes a segment to the other end of a loopback connection.
  *
- * conn: The associated connection object.
- * buf: The buffer to output.
- * len: Number of bytes to write out.
- * returns: -1 if error, otherwise the number of bytes written out.
+ * conn: The connection sending the segment.
+ * segment: The segment. The queue takes ownership of it.
+ * len: Length of the segment (including the cTCP header and data).
  */
-int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
-  /* If already wrote EOF, can't write more. */
-  if (conn->wrote_eof)
-    return 0;
-
-  /* Writing EOF. */
-  if (len == 0) {
-    conn->wrote_eof = true;
-    return 0;
+void loop_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  /* The other end is gone. */
+  if (!conn->peer) {
+    segment_free(segment);
+    return;
   }
 
-  /* If already wrote out an error, can't continue writing. */
-  if (conn->wrote_err) {
-    fprintf(stderr, "[ERROR] Attempting to write after error\n");
-    return -1;
-  }
+  struct loop_seg *l = malloc(sizeof(struct loop_seg));
+  l->dst = conn->peer;
+  l->segment = segment;
+  l->len = len;
+  l->next = NULL;
+  *loop_tail = l;
+  loop_tail = &l->next;
+}
 
-  int left = len;
-  int w = 0;
+/**
+ * [Loopback mode only]
+ * Passes the segments queued up so far to student code. Segments queued while
+ * doing so are left for the next pass through the main loop.
+ */
+void loop_drain() {
+  struct loop_seg *l = loop_head;
+  loop_head = NULL;
+  loop_tail = &loop_head;
+
+  while (l) {
+    struct loop_seg *next = l->next;
+    if (log_file != -1 || test_debug_on) {
+      log_segment(log_file, config->ip_addr, config->port, l->dst,
+                  l->segment, l->len, false, unix_socket);
+    }
+    ctcp_receive(l->dst->state, l->segment, l->len);
+    free(l);
+    l = next;
+  }
+}
 
-  /* See if there is actually room to output. */
-  if (!conn_bufspace(conn))
-    return 0;
+/**
+ * [Loopback mode only]
+ * Drops the queued segments for a connection that is going away.
+ *
+ * conn: The connection object.
+ */
+void loop_forget(conn_t *conn) {
+  struct loop_seg **prev = &loop_head;
+  while (*prev) {
+    struct loop_seg *l = *prev;
+    if (l->dst == conn) {
+      *prev = l->next;
+      segment_free(l->segment);
+      free(l);
+    }
+    else {
+      prev = &l->next;
+    }
+  }
+  loop_tail = prev;
 
-  /* Nothing in the output queue. Output immediately to the appropriate
-     interface. */
-  if (!conn->out_queue) {
-    if (run_program)
-      w = write(conn->stdin, buf, len);
-    else
-      w = write(STDOUT_FILENO, buf, len);
+  if (conn->peer)
+    conn->peer->peer = NULL;
+}
 
-    if (w < 0) {
-      if (errno != EAGAIN) {
-        if (run_program)
-          fprintf(stderr, "[INFO] Program exited\n");
-        conn->wrote_err = true;
-        return -1;
-      }
+/**
+ * Drops the delayed segments of a connection that is going away.
+ *
+ * conn: The connection object.
+ */
+void impair_forget(conn_t *conn) {
+  struct delayed_seg **prev = &delayed;
+  while (*prev) {
+    struct delayed_seg *d = *prev;
+    if (d->conn == conn) {
+      *prev = d->next;
+      segment_free(d->segment);
+      free(d);
     }
-    /* Write as much as possible. Keep track of how much was written. */
     else {
-      buf += w;
-      left -= w;
+      prev = &d->next;
     }
   }
+}
 
-  /* Put the rest in an output queue. */
-  if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
-    chunk->next = NULL;
-    chunk->size = left;
-    chunk->used = 0;
-    memcpy(chunk->buf, buf, left);
+/**
+ * Removes a connection object from the conn_t list.
+ *
+ * conn: The conn_t to free.
+ */
+void conn_free(conn_t *conn) {
+  /* Free up the output buffer. Pages still in a pipe stay valid. */
+  munmap(conn->out_buf, conn->out_cap);
+  free(conn->in_buf);
+  if (in_ring.holder == conn)
+    in_ring.holder = NULL;
+  impair_forget(conn);
+  link_free(conn->link);
+  if (loopback)
+    loop_forget(conn);
+  if (conn->stripes)
+    stripes_leave(conn);
+  if (conn->recv)
+    recv_file_finish(conn);
+
+  /* Adjust pointers. The first connection has no previous one, and the ones
+     after it move up. */
+  if (conn->next)
+    conn->next->prev = conn->prev;
 
-    /* Update pointers. */
-    *conn->out_queue_tail = chunk;
-    conn->out_queue_tail = &chunk->next;
+  if (conn == get_connections()) {
+    if (worker)
+      worker->connections = conn->next;
+    else if (SERVER)
+      config->connections = conn->next;
+    else
+      config->sconn = conn->next;
+  }
+  else if (conn->prev) {
+    *conn->prev = conn->next;
   }
 
-  /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
-    if (run_program)
-      events[conn->stdin].events |= POLLOUT;
-    else
-      events[STDOUT_FILENO].events |= POLLOUT;
+  /* Close pipes to program, if it's running. */
+  if (run_program) {
+    close(conn->stdin);
+    close(conn->stdout);
+    pthread_mutex_destroy(&conn->prog_pipe.lock);
   }
-  return len;
+  free(conn->splices);
+  free(conn);
+
+  if (filter_attached)
+    filter_update();
 }
 
 /**
- * [Client-only]
- * TCP handshake with server. This includes the SYN, SYN-ACK, and ACK segments.
+ * [Client only]
+ * Reads the next chunk of input, from STDIN or the file being sent, into the
+ * read-ahead buffer of a stripe, behind a header with the sequence number and
+ * length of the chunk (see --stripes).
  *
- * returns: A connection object if able to connect, NULL otherwise. This
- *          object must be freed.
+ * conn: The connection of the stripe.
+ * returns: The number of bytes in the read-ahead buffer, 0 on EOF, or -1 with
+ *          errno set.
  */
-conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
-  char buf[MAX_PACKET_SIZE];
+int stripe_fill(conn_t *conn) { ASSERT_CLIENT_ONLY;
+  char *data = conn->in_buf + STRIPE_HDR_SIZE;
+  uint32_t hdr[2];
+  int r;
+
+  if (send_file) {
+    r = send_size - stripe_off < STRIPE_CHUNK_SIZE ? send_size - stripe_off :
+                                                     STRIPE_CHUNK_SIZE;
+    if (r > 0)
+      memcpy(data, send_map + stripe_off, r);
+    stripe_off += r;
+  }
+  else {
+    r = read(STDIN_FILENO, data, STRIPE_CHUNK_SIZE);
+  }
+  if (r <= 0)
+    return r;
+
+  hdr[0] = htonl(stripe_seq++);
+  hdr[1] = htonl(r);
+  memcpy(conn->in_buf, hdr, STRIPE_HDR_SIZE);
+  return STRIPE_HDR_SIZE + r;
+}
+
+/**
+ * Reads input that then needs to be put into segments to send off. Reads up to
+ * to len bytes.
+ *
+ * conn: The connection object.
+ * buf: Buffer to read
+ * len: Maximum number of bytes to read.
+ * returns: -1 if error or EOF, otherwise the actual number of bytes read. If
+ *          no data is available, returns 0. The library will call ctcp_read
+ *          again once data is available from conn_input.
+ */
+int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
+  int r;
+
+  /* Check parameters. */
+  if (conn == NULL || buf == NULL) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_input\n");
+    return -1;
+  }
+
+  /* Already read EOF. */
+  if (conn->read_eof) {
+    return -1;
+  }
+
+  /* Copy straight from the file being sent. Stripes take it in chunks. */
+  if (send_file && !run_program && !conn->stripe) {
+    const char *data;
+    r = conn_input_map(conn, &data, len);
+    if (r > 0)
+      memcpy(buf, data, r);
+    return r;
+  }
+
+  /* Refill the read-ahead buffer once all of it has been handed out. Read from
+     the appropriate place (STOUT of the associated program). Nothing is left
+     to read once STDIN has ended for another connection. */
+  if (conn->in_len == 0) {
+    if (stdin_eof)
+      r = 0;
+    else if (conn->stripe)
+      r = stripe_fill(conn);
+    else if (pipeline)
+      r = in_ring_fill(conn);
+    else if (run_program)
+      r = read(conn->stdout, conn->in_buf, IN_BUF_SPACE);
+    else
+      r = read(STDIN_FILENO, conn->in_buf, IN_BUF_SPACE);
+
+    /* No input. */
+    if (r < 0 && errno == EAGAIN)
+      return 0;
+    /* Received EOF. A client's other connections get it too. */
+    if (r <= 0) {
+      conn->read_eof = true;
+      if (!SERVER)
+        stdin_eof = true;
+      return -1;
+    }
+    conn->in_head = 0;
+    conn->in_len = r;
+  }
+
+  /* Hand out as much as fits. Leave room for network-line endings, which
+     chunks of a stripe can't have. */
+  bool line_endings = !run_program && !unix_socket && !udp && !conn->stripe;
+  size_t max = line_endings ? len - 1 : len;
+  r = conn->in_len < max ? conn->in_len : max;
+  memcpy(buf, conn->in_data + conn->in_head, r);
+  conn->in_head += r;
+  conn->in_len -= r;
+
+  /* Add network-line endings if needed. */
+  if (line_endings) {
+    if (add_network_line_ending(!unix_socket, buf, r)) {
+      r += 1;
+    }
+    else if (conn->in_len > 0) {
+      ((char *) buf)[r++] = conn->in_data[conn->in_head++];
+      conn->in_len--;
+    }
+  }
+
+  /* In tester mode, we let the EOF character represent an EOF. */
+  if ((test_debug_on || lab5_mode) && !conn->stripe &&
+      ((char *) buf)[0] == 0x1a) {
+    conn->read_eof = true;
+    return -1;
+  }
+
+  return r;
+}
+
+int conn_input_map(conn_t *conn, const char **data, size_t len) { ASSERT_CONN;
+  /* Not sending a file, or already read EOF. Stripes take it in chunks. */
+  if (!send_file || run_program || conn->read_eof || conn->stripe)
+    return -1;
+
+  /* Reached the end of the file. */
+  if (conn->in_off == send_size) {
+    conn->read_eof = true;
+    return -1;
+  }
+
+  if (len > send_size - conn->in_off)
+    len = send_size - conn->in_off;
+  *data = send_map + conn->in_off;
+  conn->in_off += len;
+  return len;
+}
+
+const char *conn_input_at(conn_t *conn, size_t offset) {
+  if (!send_map || offset >= send_size || conn->stripe)
+    return NULL;
+  return send_map + offset;
+}
+
+/**
+ * Maps a file to send instead of reading from STDIN. The file is mapped at a
+ * huge-page aligned address so that it can be backed by huge pages where the
+ * file system supports it, and is read ahead sequentially.
+ *
+ * path: Path of the file.
+ * returns: 0 on success, -1 on failure.
+ */
+int send_file_map(char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", path);
+    return -1;
+  }
+  send_file = path;
+  send_size = st.st_size;
+
+  /* Nothing to map for an empty file. */
+  if (send_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  /* Reserve enough address space to align the mapping. */
+  char *addr = mmap(NULL, send_size + HUGE_PAGE_SIZE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  char *aligned = (char *) (((uintptr_t) addr + HUGE_PAGE_SIZE - 1) &
+                            ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+  send_map = mmap(aligned, send_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  close(fd);
+  if (send_map == MAP_FAILED) {
+    fprintf(stderr, "[ERROR] Could not map %s\n", path);
+    munmap(addr, send_size + HUGE_PAGE_SIZE);
+    return -1;
+  }
+
+  /* Give back the unused parts of the reservation. */
+  size_t end = (send_size + getpagesize() - 1) & ~(size_t) (getpagesize() - 1);
+  if (aligned > addr)
+    munmap(addr, aligned - addr);
+  munmap(aligned + end, addr + send_size + HUGE_PAGE_SIZE - (aligned + end));
+
+  /* Hints only, so failures don't matter. */
+  madvise(send_map, send_size, MADV_SEQUENTIAL);
+  madvise(send_map, send_size, MADV_WILLNEED);
+  madvise(send_map, send_size, MADV_HUGEPAGE);
+  return 0;
+}
+
+/**
+ * Checks if a connection has input left that it has not handed out yet,
+ * either in its read-ahead buffer or in the file being sent, or an EOF that
+ * STDIN already gave another connection. Its input file descriptor may not be
+ * readable anymore, so the main loop has to call ctcp_read for it without
+ * waiting.
+ *
+ * conn: The connection object.
+ * returns: Whether or not there is input left.
+ */
+bool conn_input_pending(conn_t *conn) {
+  if (conn->read_eof || conn->delete_me)
+    return false;
+
+  /* Slots filled by the input thread go to the most recent connection. */
+  if (pipeline && conn == get_connections() &&
+      in_ring.head != __atomic_load_n(&in_ring.tail, __ATOMIC_ACQUIRE))
+    return true;
+  return conn->in_len > 0 || (send_file && !run_program) || stdin_eof;
+}
+
+/**
+ * Checks if any connection has input left (see conn_input_pending()).
+ *
+ * returns: Whether or not there is input left.
+ */
+bool input_pending() {
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn_input_pending(conn))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Calls ctcp_read for connections with input left.
+ */
+void read_pending() {
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn_input_pending(conn))
+      ctcp_read(conn->state);
+  }
+}
+
+/**
+ * Calls ctcp_read for the connection STDIN goes to: the most recent one, or
+ * each stripe of a striped client (see --stripes), which take turns reading
+ * chunks of it.
+ */
+void stdin_read() {
+  conn_t *conn = get_connections();
+  if (num_stripes == 0) {
+    if (conn != NULL)
+      ctcp_read(conn->state);
+    return;
+  }
+  for (; conn != NULL; conn = conn->next) {
+    if (!conn->delete_me)
+      ctcp_read(conn->state);
+  }
+}
+
+/**
+ * Schedules a connection object for removal.
+ *
+ * conn: The conn_t to remove.
+ */
+void conn_remove(conn_t *conn) {
+  conn->delete_me = true;
+
+  /* Log to tester that this connection has been removed (as a result to a call
+     to ctcp_destroy). */
+  if (test_debug_on) {
+    fprintf(stderr, DEBUG_TEARDOWN);
+  }
+}
+
+/**
+ * Logs a segment and builds it into the transmit queue. Its data is copied
+ * once, straight into the queue slot behind the IP and TCP headers. With
+ * --udp, the segment is sent as it is instead.
+ *
+ * conn: Connection object.
+ * segment: The segment. The caller keeps it.
+ * len: Length of the segment (including the cTCP header and data).
+ * returns: The number of bytes actually sent, or -1 if there is an error.
+ */
+int send_segment(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+  uint16_t total_len = FULL_HDR_SIZE + data_len;
+
+  if (log_file != -1 || test_debug_on) {
+    log_segment(log_file, config->ip_addr, config->port, conn, segment,
+                len, true, unix_socket);
+  }
+
+  if (udp) {
+    memcpy(send_slot(), segment, len);
+    return queue_pkt(conn, len);
+  }
+
+  /* Convert from a cTCP segment to a real one and finally send the segment. */
+  fill_datagram(conn, segment, len, send_slot());
+  int n = queue_pkt(conn, total_len);
+  if (DEBUG) {
+    fprintf(stderr, "[DEBUG] Sent segment\n");
+    print_hdr_ctcp(segment);
+  }
+
+  /* Return number of bytes sent. Need to subtract some because the return value
+     is actually the size of the TCP segment instead of the cTCP segment. */
+  if (n >= (long int)TCP_HDR_SIZE)
+    return n - (TCP_HDR_SIZE + IP_HDR_SIZE - sizeof(ctcp_segment_t));
+  return n;
+}
+
+/**
+ * Corrupts, logs and sends a segment that made it through the other
+ * impairments.
+ *
+ * conn: Connection object.
+ * segment: The segment. It is freed.
+ * len: Length of the segment (including the cTCP header and data).
+ * level: How many times the segment has been held back or duplicated (used in
+ *        computing random values).
+ * returns: The number of bytes actually sent, or -1 if there is an error.
+ */
+int impair_deliver(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                   int level) {
+  /* Segment corruption. Flip bits in the segment after the TCP flags (to avoid
+     corrupting the flags, which may cause problems). */
+  if ((test_debug_on && !tester_did_unreliable && opt_corrupt) ||
+      (!test_debug_on && opt_corrupt && rand_percent(level) < opt_corrupt)) {
+    uint16_t data_length = len - sizeof(ctcp_segment_t) + sizeof(uint32_t);
+    uint16_t rand_bit = rand() % (data_length * 8 - 1) +
+                        (sizeof(ctcp_segment_t) - sizeof(uint32_t)) * 8;
+    tester_did_unreliable = true;
+
+    if (DEBUG) {
+      fprintf(stderr, "[DEBUG] Corrupting segment\n");
+      print_hdr_ctcp(segment);
+    }
+    flipbit(segment, rand_bit);
+  }
+
+  /* Hand straight to the other end. */
+  if (loopback) {
+    if (log_file != -1 || test_debug_on) {
+      log_segment(log_file, config->ip_addr, config->port, conn, segment,
+                  len, true, unix_socket);
+    }
+    loop_send(conn, segment, len);
+    return len;
+  }
+
+  int n = send_segment(conn, segment, len);
+  segment_free(segment);
+  return n;
+}
+
+/**
+ * Gets the current time of a monotonic clock.
+ *
+ * returns: The time, in microseconds.
+ */
+long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Sets up the emulated link that a connection sends over.
+ *
+ * returns: The link.
+ */
+struct emu_link *link_new() {
+  struct emu_link *link = calloc(1, sizeof(struct emu_link));
+  int n = __atomic_fetch_add(&num_links, 1, __ATOMIC_RELAXED);
+  link->rand = ((uint64_t) seed << 32) ^ 0x9e3779b97f4a7c15ULL ^
+               ((uint64_t) n * 0xbf58476d1ce4e5b9ULL);
+  if (link->rand == 0)
+    link->rand = 1;
+  if (link_rate > 0)
+    link->queue = calloc(link_queue, sizeof(long));
+  return link;
+}
+
+/**
+ * Frees an emulated link.
+ *
+ * link: The link, or NULL.
+ */
+void link_free(struct emu_link *link) {
+  if (!link)
+    return;
+  free(link->queue);
+  free(link);
+}
+
+/**
+ * Draws a random number from a link's generator (xorshift64*).
+ *
+ * link: The link.
+ * returns: A random number between 0 and 1.
+ */
+double link_rand(struct emu_link *link) {
+  link->rand ^= link->rand >> 12;
+  link->rand ^= link->rand << 25;
+  link->rand ^= link->rand >> 27;
+  return ((link->rand * 0x2545f4914f6cdd1dULL) >> 11) * 0x1p-53;
+}
+
+/**
+ * Passes a segment through an emulated link: Gilbert-Elliott loss, the
+ * drop-tail queue and bottleneck, then the propagation delay with jitter.
+ * Segments come out in order unless they are picked to be reordered, in which
+ * case they skip the delay and overtake the ones ahead of them.
+ *
+ * link: The link.
+ * len: Length of the segment on the wire.
+ * now: The current time, in microseconds.
+ * returns: When the segment comes out of the link, in microseconds, or -1 if
+ *          it is lost.
+ */
+long link_send(struct emu_link *link, size_t len, long now) {
+  /* Bursty loss. Change state, then lose the segment with the chance of the
+     new state. */
+  if (ge_p > 0) {
+    if (link_rand(link) < (link->bad ? ge_r : ge_p))
+      link->bad = !link->bad;
+    if (link_rand(link) < (link->bad ? ge_bad_loss : ge_good_loss))
+      return -1;
+  }
+
+  /* Bottleneck. Segments done sending have left the queue. Drop if it is
+     full. */
+  long out = now;
+  if (link_rate > 0) {
+    while (link->queued > 0 && link->queue[link->queue_head] <= now) {
+      link->queue_head = (link->queue_head + 1) % link_queue;
+      link->queued--;
+    }
+    if (link->queued == link_queue)
+      return -1;
+
+    if (link->busy_until < now)
+      link->busy_until = now;
+    link->busy_until += len * 8 * 1000 / link_rate;
+    int tail = (link->queue_head + link->queued) % link_queue;
+    link->queue[tail] = link->busy_until;
+    link->queued++;
+    out = link->busy_until;
+  }
+
+  if (link_reorder > 0 && link_rand(link) < link_reorder)
+    return out;
+
+  /* Propagation delay. */
+  long delay = link_latency;
+  if (link_jitter > 0)
+    delay += (long) (link_rand(link) * (2 * link_jitter + 1)) - link_jitter;
+  if (delay > 0)
+    out += delay;
+  if (out < link->last_due)
+    out = link->last_due;
+  link->last_due = out;
+  return out;
+}
+
+/**
+ * Holds back a segment to be sent later, if it is picked to be delayed or the
+ * emulated link takes time to deliver it, or sends it right away otherwise.
+ *
+ * conn: Connection object.
+ * segment: The segment. It is freed or held on to.
+ * len: Length of the segment (including the cTCP header and data).
+ * level: How many times the segment has been held back or duplicated.
+ * returns: The number of bytes sent or held back, or -1 if there is an error.
+ */
+int impair_send(conn_t *conn, ctcp_segment_t *segment, size_t len, int level) {
+  long now = now_us();
+  long due = now;
+
+  /* Emulated link. */
+  if (opt_link) {
+    if (!conn->link)
+      conn->link = link_new();
+    due = link_send(conn->link, len - sizeof(ctcp_segment_t) + FULL_HDR_SIZE,
+                    now);
+    if (due < 0) {
+      if (DEBUG) {
+        fprintf(stderr, "[DEBUG] Link lost segment\n");
+        print_hdr_ctcp(segment);
+      }
+      segment_free(segment);
+      return len;
+    }
+  }
+
+  /* Segment delay. */
+  if ((test_debug_on && !tester_did_unreliable && opt_delay) ||
+      (!test_debug_on && opt_delay && rand_percent(level) < opt_delay)) {
+    tester_did_unreliable = true;
+
+    if (DEBUG) {
+      fprintf(stderr, "[DEBUG] Delaying segment\n");
+      print_hdr_ctcp(segment);
+    }
+    due += (long) (rand() % MAX_DELAY) * 1000;
+    level++;
+  }
+
+  if (due <= now)
+    return impair_deliver(conn, segment, len, level);
+
+  /* Keep the segment in the delay queue, in order of when it is due. */
+  struct delayed_seg *d = calloc(1, sizeof(struct delayed_seg));
+  d->due = due;
+  d->conn = conn;
+  d->segment = segment;
+  d->len = len;
+  d->level = level;
+
+  struct delayed_seg **prev = &delayed;
+  while (*prev && (*prev)->due <= d->due)
+    prev = &(*prev)->next;
+  d->next = *prev;
+  *prev = d;
+  return len;
+}
+
+/**
+ * Sends the segments in the delay queue that are due.
+ */
+void impair_timer() {
+  long now = now_us();
+  while (delayed && delayed->due <= now) {
+    struct delayed_seg *d = delayed;
+    delayed = d->next;
+    impair_deliver(d->conn, d->segment, d->len, d->level);
+    free(d);
+  }
+}
+
+/**
+ * Shortens a poll timeout so that it ends when the next delayed segment is
+ * due.
+ *
+ * timeout: The timeout, in milliseconds.
+ * returns: The shortened timeout.
+ */
+long impair_timeout(long timeout) {
+  if (!delayed)
+    return timeout;
+
+  long due = (delayed->due - now_us() + 999) / 1000;
+  if (due < 0)
+    due = 0;
+  return due < timeout ? due : timeout;
+}
+
+/**
+ * Counts a segment sent by student code (see --stats).
+ *
+ * data_len: Length of the data in the segment.
+ */
+void stats_count(size_t data_len) {
+  if (!stats) {
+    stats = calloc(1, sizeof(struct stats));
+    int i = __atomic_fetch_add(&num_stats, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&all_stats[i], stats, __ATOMIC_RELEASE);
+  }
+
+  /* Only this thread writes its counts, but they may be read at any time. */
+  __atomic_store_n(&stats->segments, stats->segments + 1, __ATOMIC_RELAXED);
+  if (data_len > 0) {
+    __atomic_store_n(&stats->data_segments, stats->data_segments + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->data_bytes, stats->data_bytes + data_len,
+                     __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Appends a name and a number to the line printed by stats_print().
+ *
+ * p: Where to append.
+ * name: The name, with its "=".
+ * n: The number.
+ * returns: The end of what was appended.
+ */
+char *stats_append(char *p, const char *name, unsigned long n) {
+  char digits[24];
+  int i = 0;
+  while (*name)
+    *p++ = *name++;
+  do {
+    digits[i++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  while (i > 0)
+    *p++ = digits[--i];
+  return p;
+}
+
+/**
+ * Prints the counts of all threads added up (see --stats). Only uses
+ * functions that are safe to call from a signal handler.
+ */
+void stats_print() {
+  struct stats sum;
+  memset(&sum, 0, sizeof(sum));
+  int i, n = __atomic_load_n(&num_stats, __ATOMIC_RELAXED);
+  for (i = 0; i < n; i++) {
+    struct stats *t = __atomic_load_n(&all_stats[i], __ATOMIC_ACQUIRE);
+    if (!t)
+      continue;
+    sum.segments += __atomic_load_n(&t->segments, __ATOMIC_RELAXED);
+    sum.data_segments += __atomic_load_n(&t->data_segments, __ATOMIC_RELAXED);
+    sum.data_bytes += __atomic_load_n(&t->data_bytes, __ATOMIC_RELAXED);
+  }
+
+  char line[128];
+  char *p = stats_append(line, "[STATS] segments=", sum.segments);
+  p = stats_append(p, " data_segments=", sum.data_segments);
+  p = stats_append(p, " data_bytes=", sum.data_bytes);
+  *p++ = '\n';
+  if (write(STDERR_FILENO, line, p - line) < 0)
+    return;
+}
+
+/**
+ * [Server only]
+ * Prints the counts when the server is interrupted, then lets the signal
+ * end it as usual.
+ *
+ * sig: The signal.
+ */
+void stats_signal(int sig) {
+  stats_print();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/**
+ * Sends a cTCP segment to a destination associated with the provided
+ * connection object.
+ *
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Length of the segment (including the cTCP header and data).
+ *
+ * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
+ *          there in an error.
+ */
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
+  /* Check parameters. */
+  if (conn == NULL || segment == NULL) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_send\n");
+    return -1;
+  }
+  if (len < sizeof(ctcp_segment_t) || len > max_packet_size - SEG_OFFSET) {
+    fprintf(stderr, "[ERROR] Bad segment length in conn_send\n");
+    return -1;
+  }
+
+  if (opt_stats)
+    stats_count(len - sizeof(ctcp_segment_t));
+
+  /* Nothing happens to the segment on the way, so it is built straight into
+     the transmit queue. */
+  if (!loopback && !opt_drop && !opt_duplicate && !opt_delay &&
+      !opt_corrupt && !opt_link)
+    return send_segment(conn, segment, len);
+
+  /* Otherwise make a copy of the segment first, as it may be held on to. */
+  ctcp_segment_t *segment_copy = segment_alloc(len);
+  memcpy(segment_copy, segment, len);
+
+  /* Segment drop. Don't send the segment. */
+  if ((test_debug_on && !tester_did_unreliable && opt_drop) ||
+      (!test_debug_on && opt_drop && rand_percent(0) < opt_drop)) {
+    tester_did_unreliable = true;
+
+    if (DEBUG) {
+      fprintf(stderr, "[DEBUG] Dropping segment\n");
+      print_hdr_ctcp(segment_copy);
+    }
+    segment_free(segment_copy);
+    return len;
+  }
+
+  /* Segment duplication. The other copy goes through the rest of the
+     unreliability on its own. */
+  if ((test_debug_on && !tester_did_unreliable && opt_duplicate) ||
+      (!test_debug_on && opt_duplicate && rand_percent(0) < opt_duplicate)) {
+    tester_did_unreliable = true;
+
+    if (DEBUG) {
+      fprintf(stderr, "[DEBUG] Duplicating segment\n");
+      print_hdr_ctcp(segment_copy);
+    }
+    ctcp_segment_t *dup = segment_alloc(len);
+    memcpy(dup, segment, len);
+    impair_send(conn, dup, len, 1);
+  }
+
+  return impair_send(conn, segment_copy, len, 0);
+}
+
+/**
+ * Hands the file being received into to a connection, unless another one has
+ * it already. Connections on different worker threads can be set up at the
+ * same time.
+ *
+ * conn: The connection object.
+ */
+void recv_file_claim(conn_t *conn) {
+  int fd = __atomic_exchange_n(&recv_fd, -1, __ATOMIC_ACQ_REL);
+  if (fd < 0)
+    return;
+  conn->recv = calloc(sizeof(struct recv_file), 1);
+  conn->recv->fd = fd;
+}
+
+/**
+ * Makes room in the file being received into for data up to the given end,
+ * growing the file and its mapping as well as the hole bitmap. Disk space is
+ * allocated before it is mapped, so a full disk fails here instead of faulting
+ * when the mapping is written.
+ *
+ * rf: The file.
+ * end: End of the data to make room for.
+ * returns: 0 on success, -1 on failure.
+ */
+int recv_file_reserve(struct recv_file *rf, size_t end) {
+  if (end > rf->cap) {
+    size_t cap = rf->cap ? rf->cap : RECV_FILE_CHUNK;
+    while (cap < end)
+      cap *= 2;
+    if (posix_fallocate(rf->fd, rf->cap, cap - rf->cap) != 0)
+      return -1;
+
+    char *map = rf->map ?
+      mremap(rf->map, rf->cap, cap, MREMAP_MAYMOVE) :
+      mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, rf->fd, 0);
+    if (map == MAP_FAILED)
+      return -1;
+    rf->map = map;
+    rf->cap = cap;
+  }
+
+  size_t words = (end - rf->base + 63) / 64;
+  if (words > rf->words) {
+    if (words < 2 * rf->words)
+      words = 2 * rf->words;
+    rf->holes = realloc(rf->holes, words * sizeof(uint64_t));
+    memset(rf->holes + rf->words, 0, (words - rf->words) * sizeof(uint64_t));
+    rf->words = words;
+  }
+  return 0;
+}
+
+/**
+ * Marks bytes of the file being received into as placed and advances the
+ * high-water mark past them if possible.
+ *
+ * rf: The file.
+ * offset: Offset of the bytes.
+ * len: Number of bytes.
+ */
+void recv_file_mark(struct recv_file *rf, size_t offset, size_t len) {
+  size_t i;
+
+  /* Whole words in the middle are set at once, and only the words at either
+     end are masked. */
+  if (len > 0) {
+    size_t first = offset - rf->base;
+    size_t last = first + len - 1;
+    uint64_t head = ~(uint64_t) 0 << (first % 64);
+    uint64_t tail = ~(uint64_t) 0 >> (63 - last % 64);
+    if (first / 64 == last / 64)
+      rf->holes[first / 64] |= head & tail;
+    else {
+      rf->holes[first / 64] |= head;
+      for (i = first / 64 + 1; i < last / 64; i++)
+        rf->holes[i] = ~(uint64_t) 0;
+      rf->holes[last / 64] |= tail;
+    }
+  }
+
+  /* Skip to the first byte not yet placed. */
+  i = rf->hwm - rf->base;
+  while (i < rf->end - rf->base) {
+    uint64_t missing = ~rf->holes[i / 64] >> (i % 64);
+    if (missing) {
+      i += __builtin_ctzll(missing);
+      break;
+    }
+    i += 64 - i % 64;
+  }
+  rf->hwm = rf->base + (i < rf->end - rf->base ? i : rf->end - rf->base);
+
+  /* Drop the part of the bitmap before the high-water mark once it makes up
+     half of the bitmap. */
+  size_t done = (rf->hwm - rf->base) / 64;
+  if (done > 0 && done >= rf->words / 2) {
+    memmove(rf->holes, rf->holes + done,
+            (rf->words - done) * sizeof(uint64_t));
+    memset(rf->holes + rf->words - done, 0, done * sizeof(uint64_t));
+    rf->base += done * 64;
+  }
+}
+
+/**
+ * Places output in the file being received at its offset (see --recv-file).
+ *
+ * rf: The file.
+ * offset: Offset of the output in the file.
+ * buf: The output.
+ * len: Length of the output.
+ * returns: len, or -1 if the file could not be grown.
+ */
+int recv_file_write(struct recv_file *rf, size_t offset, const char *buf,
+                    size_t len) {
+  size_t n = len;
+
+  /* Already placed. */
+  if (offset + len <= rf->hwm)
+    return n;
+
+  if (recv_file_reserve(rf, offset + len) < 0) {
+    fprintf(stderr, "[ERROR] Could not grow %s\n", recv_path);
+    return -1;
+  }
+  memcpy(rf->map + offset, buf, len);
+  if (offset + len > rf->end)
+    rf->end = offset + len;
+  if (offset < rf->hwm) {
+    len -= rf->hwm - offset;
+    offset = rf->hwm;
+  }
+  recv_file_mark(rf, offset, len);
+  return n;
+}
+
+int conn_output_at(conn_t *conn, size_t offset, const char *buf, size_t len) {
+  ASSERT_CONN;
+  if (!conn->recv || conn->wrote_eof || conn->stripes)
+    return -1;
+  return recv_file_write(conn->recv, offset, buf, len);
+}
+
+int64_t conn_output_hwm(conn_t *conn) {
+  /* The stripes of a client are put back in order before they are placed. */
+  if (!conn->recv || conn->stripes)
+    return -1;
+  return conn->recv->hwm;
+}
+
+/**
+ * Opens a file to receive into instead of writing to STDOUT.
+ *
+ * path: Path of the file.
+ * returns: 0 on success, -1 on failure.
+ */
+int recv_file_open(char *path) {
+  recv_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (recv_fd < 0) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", path);
+    return -1;
+  }
+  recv_path = path;
+  return 0;
+}
+
+/**
+ * Cuts the file a connection received into down to the end of the data, and
+ * lets go of it. Any further output of the connection goes to STDOUT.
+ *
+ * conn: The connection object.
+ */
+void recv_file_finish(conn_t *conn) {
+  struct recv_file *rf = conn->recv;
+  if (rf->map)
+    munmap(rf->map, rf->cap);
+  if (ftruncate(rf->fd, rf->end) < 0)
+    fprintf(stderr, "[ERROR] Could not truncate %s\n", recv_path);
+  close(rf->fd);
+  free(rf->holes);
+  free(rf);
+  conn->recv = NULL;
+}
+
+/**
+ * Writes a buffer to STDOUT or the program associated with this connection.
+ * If called with a length of 0, an EOF is recorded. Same as conn_output(),
+ * except that the output is not taken as a stripe of a client.
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int conn_write(conn_t *conn, const char *buf, size_t len) {
+  /* If already wrote EOF, can't write more. */
+  if (conn->wrote_eof)
+    return 0;
+
+  /* Writing EOF. */
+  if (len == 0) {
+    conn->wrote_eof = true;
+    if (conn->recv)
+      recv_file_finish(conn);
+    return 0;
+  }
+
+  /* If already wrote out an error, can't continue writing. */
+  if (conn->wrote_err) {
+    fprintf(stderr, "[ERROR] Attempting to write after error\n");
+    return -1;
+  }
+
+  /* Hand off to the output thread. */
+  if (pipeline) {
+    int w = out_ring_push(buf, len);
+    if (w < 0)
+      conn->wrote_err = true;
+    return w;
+  }
+
+  size_t left = len;
+  size_t space = out_buf_space(conn);
+  bool splice = run_program ? conn->out_splice : stdout_splice;
+  int w = 0;
+
+  /* See if there is actually room to output. */
+  if (!space)
+    return 0;
+
+  /* Nothing in the output buffer. Output immediately to the appropriate
+     interface. The io_uring backend and splicing do all of their output from
+     the buffer instead. */
+  if (conn->out_len == 0 && !use_uring && !splice) {
+    if (run_program)
+      w = write(conn->stdin, buf, len);
+    else
+      w = write(STDOUT_FILENO, buf, len);
+
+    if (w < 0) {
+      if (errno != EAGAIN) {
+        if (run_program)
+          fprintf(stderr, "[INFO] Program exited\n");
+        conn->wrote_err = true;
+        return -1;
+      }
+    }
+    /* Write as much as possible. Keep track of how much was written. */
+    else {
+      buf += w;
+      left -= w;
+    }
+  }
+
+  /* Put as much of the rest as fits in the output buffer. */
+  if (left > space) {
+    len -= left - space;
+    left = space;
+  }
+  if (left > 0)
+    out_buf_append(conn, buf, left);
+
+  /* If there is stuff in the buffer, create an event. */
+  if (use_uring || splice) {
+    out_buf_flush(conn);
+  }
+  else if (conn->out_len > 0) {
+    if (run_program)
+      events[conn->stdin].events |= POLLOUT;
+    else
+      events[STDOUT_FILENO].events |= POLLOUT;
+  }
+  return len;
+}
+
+/**
+ * Writes a buffer to STDOUT or the program associated with this connection.
+ * If called with a length of 0, an EOF is recorded. Output of a striped client
+ * is put back in order with its other stripes first (see stripes_output()).
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
+  if (conn->stripes)
+    return stripes_output(conn, buf, len);
+  return conn_write(conn, buf, len);
+}
+
+/**
+ * [Server only]
+ * Adds a new connection to the stripes of its client, starting them if it is
+ * the first one (see --stripes). Output goes through the first one.
+ *
+ * conn: The new connection. Its stripe has been checked.
+ */
+void stripes_join(conn_t *conn) { ASSERT_SERVER_ONLY;
+  int count = conn->stripe >> 8;
+  conn_t *other;
+  for (other = get_connections(); other != NULL; other = other->next) {
+    if (other->stripes && !other->delete_me && other->port == conn->port &&
+        (unix_socket || other->ip_addr == conn->ip_addr) &&
+        other->stripes->count == count) {
+      conn->stripes = other->stripes;
+      conn->stripes->num_conns++;
+      return;
+    }
+  }
+
+  conn->stripes = calloc(sizeof(struct stripes), 1);
+  conn->stripes->count = count;
+  conn->stripes->num_conns = 1;
+  conn->stripes->out = conn;
+}
+
+/**
+ * [Server only]
+ * Takes a connection out of the stripes of its client. The stripes are freed
+ * along with the last one.
+ *
+ * conn: The connection being freed.
+ */
+void stripes_leave(conn_t *conn) {
+  struct stripes *s = conn->stripes;
+  struct chunk *chunk;
+  if (--s->num_conns > 0)
+    return;
+
+  while ((chunk = s->chunks) != NULL) {
+    s->chunks = chunk->next;
+    free(chunk);
+  }
+  free(s);
+}
+
+/**
+ * [Server only]
+ * Checks whether the connection the output of a striped client goes through
+ * has to stay around after student code is done with it: other stripes are
+ * still going, or there is output left.
+ *
+ * s: The stripes.
+ * returns: Whether or not the output connection is still needed.
+ */
+bool stripes_busy(struct stripes *s) {
+  conn_t *out = s->out;
+  if (s->num_conns > 1)
+    return true;
+  if (out->wrote_err)
+    return false;
+  return (s->chunks && s->chunks->seq == s->next_seq) ||
+         out->out_len > out->out_pipe;
+}
+
+/**
+ * [Server only]
+ * Adds a chunk of a striped client, in order of sequence number.
+ *
+ * s: The stripes of the client.
+ * seq: Sequence number of the chunk.
+ * len: Length of the chunk.
+ * returns: The chunk, or NULL if it is not valid.
+ */
+struct chunk *chunk_add(struct stripes *s, uint32_t seq, uint32_t len) {
+  struct chunk **prev, *chunk;
+  if (len > STRIPE_CHUNK_SIZE || (int32_t) (seq - s->next_seq) < 0)
+    return NULL;
+
+  for (prev = &s->chunks; *prev != NULL; prev = &(*prev)->next) {
+    if ((*prev)->seq == seq)
+      return NULL;
+    if ((int32_t) ((*prev)->seq - seq) > 0)
+      break;
+  }
+  chunk = malloc(sizeof(struct chunk) + len);
+  if (chunk == NULL)
+    return NULL;
+  chunk->seq = seq;
+  chunk->len = len;
+  chunk->filled = 0;
+  chunk->done = 0;
+  chunk->next = *prev;
+  *prev = chunk;
+  return chunk;
+}
+
+/**
+ * [Server only]
+ * Calls student code for the stripes of a client that were short of output
+ * space, until none of them can get any further. The stripe whose chunk is
+ * needed soonest goes first, so that none of them is held back for long.
+ *
+ * s: The stripes of the client.
+ */
+void stripes_kick(struct stripes *s) {
+  conn_t *conn, *next;
+  uint32_t ahead, next_ahead = 0;
+
+  /* Student code outputs from here, which comes back here. */
+  if (s->kicking)
+    return;
+  s->kicking = true;
+  while (true) {
+    next = NULL;
+    for (conn = get_connections(); conn != NULL; conn = conn->next) {
+      if (conn->stripes != s || !conn->out_blocked || conn->delete_me)
+        continue;
+      ahead = conn->chunk ? conn->chunk->seq - s->next_seq : 0;
+      if (next == NULL || ahead < next_ahead) {
+        next = conn;
+        next_ahead = ahead;
+      }
+    }
+    if (next == NULL)
+      break;
+
+    next->out_blocked = false;
+    ctcp_output(next->state);
+    if (next->out_blocked)
+      break;
+  }
+  s->kicking = false;
+}
+
+/**
+ * [Server only]
+ * Outputs the chunks of a striped client that are next in order, as far as
+ * there is room, then lets the stripes that were held up continue. The output
+ * ends once all of the stripes have.
+ *
+ * s: The stripes of the client.
+ */
+void stripes_flush(struct stripes *s) {
+  struct chunk *chunk;
+  int w;
+  while ((chunk = s->chunks) != NULL && chunk->seq == s->next_seq) {
+    if (chunk->done < chunk->filled) {
+      if (s->out->recv)
+        w = recv_file_write(s->out->recv, s->written,
+                            chunk->data + chunk->done,
+                            chunk->filled - chunk->done);
+      else
+        w = conn_write(s->out, chunk->data + chunk->done,
+                       chunk->filled - chunk->done);
+      if (w < 0) {
+        s->out->wrote_err = true;
+        return;
+      }
+      chunk->done += w;
+      s->written += w;
+      s->buffered -= w;
+    }
+
+    /* Out of room, or the rest has not been received yet. */
+    if (chunk->done < chunk->len)
+      break;
+    s->chunks = chunk->next;
+    s->next_seq++;
+    free(chunk);
+  }
+
+  if (s->num_eof == s->count && s->chunks == NULL)
+    conn_write(s->out, NULL, 0);
+  stripes_kick(s);
+}
+
+/**
+ * [Server only]
+ * Checks how much output a stripe of a client can take. Chunks that are less
+ * than one for each stripe ahead of the chunk that is output next are always
+ * taken. Each stripe sends one chunk at a time, so the chunks that are needed
+ * next are never held back. Chunks further ahead are taken while the chunks
+ * waiting to be output take up less than STRIPE_BUF_SPACE bytes.
+ *
+ * conn: The connection of the stripe.
+ * returns: The number of bytes that can be taken.
+ */
+size_t stripes_space(conn_t *conn) {
+  struct stripes *s = conn->stripes;
+  if (conn->chunk == NULL ||
+      conn->chunk->seq - s->next_seq < (uint32_t) s->count)
+    return max_seg_size;
+  if (s->buffered + max_seg_size <= STRIPE_BUF_SPACE)
+    return STRIPE_BUF_SPACE - s->buffered;
+
+  /* Let the stripe continue once there is room, or its chunk is close
+     enough. */
+  conn->out_blocked = true;
+  return 0;
+}
+
+/**
+ * [Server only]
+ * Takes output of a stripe of a client: splits it into the chunks it carries
+ * and outputs whatever is next in order (see stripes_flush()).
+ *
+ * conn: The connection of the stripe.
+ * buf: The output.
+ * len: Length of the output, or 0 for EOF.
+ * returns: -1 if the output is not valid, otherwise len.
+ */
+int stripes_output(conn_t *conn, const char *buf, size_t len) {
+  struct stripes *s = conn->stripes;
+  struct chunk *chunk;
+  uint32_t hdr[2];
+  size_t n, left = len;
+
+  if (conn->stripe_eof)
+    return 0;
+
+  /* Student code is outputting, so is not held up. It can't be called for
+     this stripe again until it is (see stripes_kick()). */
+  conn->out_blocked = false;
+  if (len == 0) {
+    conn->stripe_eof = true;
+    s->num_eof++;
+  }
+
+  while (left > 0) {
+    /* Header of the next chunk. */
+    if (conn->chunk == NULL) {
+      n = STRIPE_HDR_SIZE - conn->chunk_hdr_len;
+      if (n > left)
+        n = left;
+      memcpy(conn->chunk_hdr + conn->chunk_hdr_len, buf, n);
+      conn->chunk_hdr_len += n;
+      buf += n;
+      left -= n;
+      if (conn->chunk_hdr_len < STRIPE_HDR_SIZE)
+        break;
+
+      conn->chunk_hdr_len = 0;
+      memcpy(hdr, conn->chunk_hdr, STRIPE_HDR_SIZE);
+      chunk = chunk_add(s, ntohl(hdr[0]), ntohl(hdr[1]));
+      if (chunk == NULL) {
+        fprintf(stderr, "[ERROR] Not a valid chunk from a striped client\n");
+        return -1;
+      }
+      if (chunk->len > 0)
+        conn->chunk = chunk;
+      continue;
+    }
+
+    /* Data of the chunk. */
+    chunk = conn->chunk;
+    n = chunk->len - chunk->filled;
+    if (n > left)
+      n = left;
+    memcpy(chunk->data + chunk->filled, buf, n);
+    chunk->filled += n;
+    s->buffered += n;
+    buf += n;
+    left -= n;
+    if (chunk->filled == chunk->len)
+      conn->chunk = NULL;
+  }
+
+  stripes_flush(s);
+  return len;
+}
+
+/**
+ * [Server only]
+ * Handle a new connection from a client. Set up connection details and
+ * initialize sequence numbers.
+ *
+ * pkt: The SYN segment from the client.
+ * returns: The conn_t associated with the new connection.
+ */
+conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
+  /* Ignore if too many clients are connected. */
+  if (num_connected >= MAX_NUM_CLIENTS) {
+    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
+            MAX_NUM_CLIENTS);
+    return NULL;
+  }
+
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+
+  /* A stripe of a client's input (see --stripes). A program would only get
+     the input of one connection, so can't be run for a striped client. */
+  uint16_t stripe = ntohs(syn->th_urp);
+  int count = stripe >> 8, index = (stripe & 0xff) - 1;
+  if (stripe != 0 &&
+      (run_program || count > MAX_STRIPES || index < 0 || index >= count)) {
+    fprintf(stderr, "[ERROR] Can't take stripe %d of %d from a client\n",
+            index + 1, count);
+    return NULL;
+  }
+  num_connected++;
+
+  /* Set up connection details and add to list of connections. */
+  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn_setup(conn, ip_hdr->saddr, ntohs(syn->th_sport), unix_socket);
+  conn->their_init_seqno = ntohl(syn->th_seq);
+  conn->ackno = conn->their_init_seqno + 1;
+  conn->stripe = stripe;
+  conn_add(conn);
+  if (stripe != 0)
+    stripes_join(conn);
+
+  /* Output of a striped client goes through the first of its stripes. */
+  if (stripe == 0 || conn->stripes->out == conn)
+    recv_file_claim(conn);
+
+  /* Send a SYN-ACK to the client. */
+  send_synack(conn);
+
+  /* Get window size of the client. */
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  config_copy->send_window = ntohs(syn->window);
+  config_copy->max_seg_size = seg_size_agree(tcp_mss_option(ip_hdr));
+
+  /* Student code. */
+  ctcp_state_t *state = ctcp_init(conn, config_copy);
+  conn->state = state;
+
+  fprintf(stderr, "[INFO] Client connected\n");
+  return conn;
+}
+
+/**
+ * [UDP only]
+ * Sends a cTCP segment that sets up a connection (a SYN or SYN-ACK), along
+ * with our receive window. Its data is the most data we take in a segment.
+ *
+ * dst: A conn_t object associated with the destination.
+ * flags: TCP flags.
+ *
+ * returns: -1 if error, 0 otherwise.
+ */
+int udp_send_conn_seg(conn_t *dst, int flags) {
+  char buf[UDP_CONN_SEG_SIZE];
+  ctcp_segment_t *segment = (ctcp_segment_t *) buf;
+  uint16_t mss = htons(max_seg_size);
+  memset(buf, 0, sizeof(buf));
+  segment->len = htons(sizeof(buf));
+  segment->flags = flags;
+  segment->window = htons(ctcp_cfg->recv_window);
+  memcpy(segment->data, &mss, sizeof(mss));
+  segment->cksum = cksum(buf, sizeof(buf));
+
+  if (send_pkt(dst, config->socket, buf, sizeof(buf), 0) < 0) {
+    fprintf(stderr, "[ERROR] Could not connect\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * [UDP only]
+ * Gets the most data the other host takes in a segment from its SYN or
+ * SYN-ACK (see udp_send_conn_seg()).
+ *
+ * segment: The SYN or SYN-ACK.
+ * len: Length of the segment.
+ * returns: The segment size, or MAX_SEG_DATA_SIZE if there is none.
+ */
+uint16_t udp_mss(ctcp_segment_t *segment, int len) {
+  uint16_t mss;
+  if (len < UDP_CONN_SEG_SIZE)
+    return MAX_SEG_DATA_SIZE;
+  memcpy(&mss, segment->data, sizeof(mss));
+  return ntohs(mss) ? ntohs(mss) : MAX_SEG_DATA_SIZE;
+}
+
+/**
+ * [Client only]
+ * Sends a SYN to a server being connected to.
+ *
+ * conn: The connection to the server.
+ */
+void send_conn_syn(conn_t *conn) { ASSERT_CLIENT_ONLY;
+  if (udp)
+    udp_send_conn_seg(conn, TH_SYN);
+  else
+    send_syn(conn);
+}
+
+/**
+ * [Client only]
+ * Starts connecting to each server: sends it a SYN and lets the main loop wait
+ * for its SYN-ACK (see syn_timer() and conn_connected()), so that all of the
+ * handshakes happen at once.
+ */
+void connect_servers() { ASSERT_CLIENT_ONLY;
+  long now = now_us();
+  conn_t *conn;
+  for (conn = config->connecting; conn != NULL; conn = conn->next) {
+    conn->syn_interval = SYN_INTERVAL * 1000L;
+    conn->syn_due = now + conn->syn_interval;
+    conn->syn_give_up = now + CONN_TIMEOUT * 1000000L;
+    send_conn_syn(conn);
+  }
+}
+
+/**
+ * [Client only]
+ * Sends the SYN again to servers that have not answered in time, waiting twice
+ * as long for each one. Gives up on a server after CONN_TIMEOUT seconds, and
+ * ends the client if there is nothing left to wait for.
+ */
+void syn_timer() {
+  conn_t **prev, *conn;
+  long now;
+  if (SERVER || loopback || config->connecting == NULL)
+    return;
+
+  now = now_us();
+  prev = &config->connecting;
+  while ((conn = *prev) != NULL) {
+    if (now >= conn->syn_give_up) {
+      fprintf(stderr, "[ERROR] Could not connect to server!\n");
+      *prev = conn->next;
+      free(conn);
+      connect_failed = true;
+      continue;
+    }
+    if (now >= conn->syn_due) {
+      send_conn_syn(conn);
+      conn->syn_interval *= 2;
+      if (conn->syn_interval > SYN_INTERVAL_MAX * 1000L)
+        conn->syn_interval = SYN_INTERVAL_MAX * 1000L;
+      conn->syn_due = now + conn->syn_interval;
+    }
+    prev = &conn->next;
+  }
+
+  if (config->connecting == NULL && connect_failed)
+    end_client();
+}
+
+/**
+ * [Client only]
+ * Finishes connecting to a server once the handshake is done: moves the
+ * connection over to the connected ones and goes to student code. STDIN goes
+ * to the most recently connected server, so it starts being read once the
+ * first one is connected.
+ *
+ * conn: The connection to the server.
+ * cfg: Configuration for student code, with the window and segment size
+ *      agreed on with the server.
+ */
+void conn_connected(conn_t *conn, ctcp_config_t *cfg) { ASSERT_CLIENT_ONLY;
+  conn_t **prev = &config->connecting;
+  while (*prev != conn)
+    prev = &(*prev)->next;
+  *prev = conn->next;
+  conn->next = NULL;
+  conn_add(conn);
+  recv_file_claim(conn);
 
-  /* Send a SYN segment to the server. */
-  if (send_syn(config->sconn))
-    exit(EXIT_FAILURE);
+  /* Student code. */
+  conn->state = ctcp_init(conn, cfg);
+  if (conn->state == NULL) {
+    fprintf(stderr, "[ERROR] Could not connect to server!\n");
+    conn_remove(conn);
+    connect_failed = true;
+    end_client();
+    return;
+  }
+  fprintf(stderr, "[INFO] Connected to server\n");
 
-  /* Wait to receive SYN-ACK. */
-  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
-  if (r <= 0)
+  if (events[STDOUT_FILENO].fd < 0)
+    events[STDOUT_FILENO].fd = stdout_poll_fd;
+  if (events[STDIN_FILENO].fd < 0 && stdin_poll_fd >= 0 && !stdin_eof) {
+    events[STDIN_FILENO].fd = stdin_poll_fd;
+    if (use_uring)
+      uring_poll_stdin();
+  }
+}
+
+/**
+ * [Client only]
+ * Handles the answer to a SYN from a server being connected to: a SYN-ACK,
+ * or an ACK if the server still has a previous connection with this client.
+ *
+ * conn: The connection to the server.
+ * pkt: The packet from the server.
+ */
+void tcp_connected(conn_t *conn, char *pkt) { ASSERT_CLIENT_ONLY;
+  tcphdr_t *synack = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  if ((synack->th_flags & TH_ACK) == 0)
+    return;
+
+  /* Set window size for the other host, and agree on the segment size. */
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  config_copy->send_window = ntohs(synack->window);
+  config_copy->max_seg_size = seg_size_agree(tcp_mss_option((iphdr_t *) pkt));
+
+  /* If an ACK is received instead of a SYN-ACK, continue previous
+     connection. Get sequence numbers from previous connection. */
+  if ((synack->th_flags & TH_SYN) == 0) {
+    conn->init_seqno = ntohl(synack->th_ack) - 1;
+    conn->their_init_seqno = ntohl(synack->th_seq) - 1;
+
+    conn->next_seqno = conn->init_seqno + 1;
+    conn->ackno = ntohl(synack->th_seq);
+  }
+
+  /* Otherwise, set new acknowledgement number and send ACK response */
+  else {
+    conn->next_seqno++;
+    conn->their_init_seqno = ntohl(synack->th_seq);
+    conn->ackno = ntohl(synack->th_seq) + 1;
+    send_ack(conn);
+  }
+
+  conn_connected(conn, config_copy);
+}
+
+/**
+ * [Client only, UDP only]
+ * Handles the SYN-ACK from a server being connected to. Same as
+ * tcp_connected(), except that there are no sequence numbers to agree on,
+ * since segments are sent as they are.
+ *
+ * conn: The connection to the server.
+ * synack: The SYN-ACK from the server.
+ * len: Length of the SYN-ACK.
+ */
+void udp_connected(conn_t *conn, ctcp_segment_t *synack, int len) {
+  /* Set window size for the other host, and agree on the segment size. */
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  config_copy->send_window = ntohs(synack->window);
+  config_copy->max_seg_size = seg_size_agree(udp_mss(synack, len));
+  conn_connected(conn, config_copy);
+}
+
+/**
+ * [Server only, UDP only]
+ * Handle a new connection from a client. Same as tcp_new_connection(),
+ * without sequence numbers.
+ *
+ * syn: The SYN segment from the client.
+ * len: Length of the SYN segment.
+ * from: Address of the client.
+ * returns: The conn_t associated with the new connection.
+ */
+conn_t *udp_new_connection(ctcp_segment_t *syn, int len,
+                           struct sockaddr_in *from) { ASSERT_SERVER_ONLY;
+  /* Ignore if too many clients are connected. */
+  if (num_connected >= MAX_NUM_CLIENTS) {
+    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
+            MAX_NUM_CLIENTS);
     return NULL;
+  }
+  num_connected++;
+
+  /* Set up connection details and add to list of connections. */
+  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn_setup(conn, from->sin_addr.s_addr, ntohs(from->sin_port), false);
+  conn->saddr.sin_port = from->sin_port;
+  conn_add(conn);
+  recv_file_claim(conn);
+
+  /* Send a SYN-ACK to the client. */
+  udp_send_conn_seg(conn, TH_SYN | TH_ACK);
+
+  /* Get window size of the client. */
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  config_copy->send_window = ntohs(syn->window);
+  config_copy->max_seg_size = seg_size_agree(udp_mss(syn, len));
+
+  /* Student code. */
+  ctcp_state_t *state = ctcp_init(conn, config_copy);
+  conn->state = state;
+
+  fprintf(stderr, "[INFO] Client connected\n");
+  return conn;
+}
+
+
+////////////////////////////// IO_URING BACKEND ///////////////////////////////
+
+/** Kinds of io_uring requests. Stored in the low bits of the user data, the
+    rest of which is the associated conn_t (if any). */
+#define UR_RECV 0
+#define UR_STDIN 1
+#define UR_PROGRAM 2
+#define UR_WRITE 3
+#define UR_WRITABLE 4
+#define UR_CANCEL 5
+#define UR_KIND_MASK 7
+
+/** Buffer group for the provided receive buffers. */
+#define UR_BUF_GROUP 0
+
+/** An io_uring instance, with its rings mapped into memory. Receives go into
+    a ring of buffers registered with the kernel, which picks one for each
+    packet. */
+struct uring {
+  int fd;
+  unsigned to_submit;           /* SQEs queued but not yet submitted */
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  unsigned num_bufs;            /* Number of receive buffers, a power of 2 */
+  unsigned short buf_tail;
+  char *bufs;                   /* num_bufs * max_packet_size bytes */
+};
+
+static struct uring uring;
+
+/**
+ * Submits queued SQEs and optionally waits for a completion.
+ *
+ * timeout: Maximum time to wait in milliseconds, or -1 to not wait at all.
+ * returns: -1 on failure, the number of SQEs submitted otherwise.
+ */
+int uring_enter(long timeout) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  int r;
+
+  memset(&arg, 0, sizeof(arg));
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    arg.ts = (uint64_t) &ts;
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+
+  r = syscall(__NR_io_uring_enter, uring.fd, uring.to_submit,
+              timeout >= 0 ? 1 : 0, flags, &arg, sizeof(arg));
+  if (r < 0)
+    return (errno == ETIME || errno == EINTR) ? 0 : -1;
+  uring.to_submit -= r;
+  return r;
+}
+
+/**
+ * Gets a free SQE, submitting what has been queued so far if the submission
+ * queue is full. The SQE is cleared and queued for the next submission.
+ *
+ * returns: The SQE.
+ */
+struct io_uring_sqe *uring_sqe() {
+  unsigned tail = *uring.sq_tail;
+
+  while (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >=
+         uring.sq_entries)
+    uring_enter(-1);
+
+  unsigned index = tail & *uring.sq_mask;
+  struct io_uring_sqe *sqe = &uring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  uring.sq_array[index] = index;
+  __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring.to_submit++;
+  return sqe;
+}
+
+/**
+ * Hands a receive buffer (back) to the kernel.
+ *
+ * id: Index of the buffer.
+ */
+void uring_recycle_buf(unsigned short id) {
+  struct io_uring_buf *buf =
+    &uring.buf_ring->bufs[uring.buf_tail & (uring.num_bufs - 1)];
+  buf->addr = (uint64_t) (uring.bufs + id * max_packet_size);
+  buf->len = max_packet_size;
+  buf->bid = id;
+  uring.buf_tail++;
+  __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Posts a multishot receive on the socket. It keeps completing, once for
+ * every packet, until the kernel runs out of receive buffers.
+ */
+void uring_recv() {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = config->socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UR_BUF_GROUP;
+  sqe->user_data = UR_RECV;
+}
+
+/**
+ * Polls a file descriptor once. The poll is re-armed after every completion
+ * so that, like poll(), it keeps firing as long as the condition holds.
+ *
+ * fd: File descriptor to poll.
+ * mask: Events to poll for.
+ * user_data: Request kind and associated conn_t.
+ */
+void uring_poll(int fd, short mask, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = mask;
+  sqe->user_data = user_data;
+}
+
+void uring_poll_stdin() {
+  uring_poll(STDIN_FILENO, POLLIN | POLLHUP | POLLERR, UR_STDIN);
+}
+
+void uring_poll_program(conn_t *conn) {
+  conn->uring_pending++;
+  uring_poll(conn->stdout, POLLIN | POLLHUP,
+             (uint64_t) conn | UR_PROGRAM);
+}
+
+void uring_poll_writable(conn_t *conn) {
+  conn->uring_pending++;
+  uring_poll(run_program ? conn->stdin : STDOUT_FILENO, POLLOUT,
+             (uint64_t) conn | UR_WRITABLE);
+}
+
+void uring_write(conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = run_program ? conn->stdin : STDOUT_FILENO;
+  sqe->addr = (uint64_t) conn->out_iov;
+  sqe->len = out_buf_iov(conn, conn->out_iov);
+  sqe->off = -1;
+  sqe->user_data = (uint64_t) conn | UR_WRITE;
+  conn->uring_writing = true;
+  conn->uring_pending++;
+}
+
+/**
+ * Cancels a kind of request referring to a connection, all of them if there
+ * are several.
+ *
+ * conn: The connection object.
+ * kind: Request kind.
+ */
+void uring_cancel_kind(conn_t *conn, uint64_t kind) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t) conn | kind;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = UR_CANCEL;
+}
+
+/**
+ * Cancels every request still referring to a connection that is about to be
+ * freed: polls of its program, writes of its output and waits for the output
+ * to become writable. Their completions post nothing new once the connection
+ * is cancelled.
+ *
+ * conn: The connection object.
+ */
+void uring_cancel(conn_t *conn) {
+  uring_cancel_kind(conn, UR_PROGRAM);
+  uring_cancel_kind(conn, UR_WRITE);
+  uring_cancel_kind(conn, UR_WRITABLE);
+  conn->uring_cancelled = true;
+}
+
+/**
+ * Handles the completion of a write of the output queue.
+ *
+ * conn: The connection object.
+ * res: Result of the write.
+ */
+void uring_write_done(conn_t *conn, int res) {
+  /* Whether or not student code could have been held up by a lack of space. */
+  bool held_up = out_buf_space(conn) < max_seg_size;
+  conn->uring_writing = false;
+  if (conn->uring_cancelled)
+    return;
 
-  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
+  /* The output is non-blocking and full. Wait until it is writable. */
+  if (res == -EAGAIN) {
+    uring_poll_writable(conn);
+    return;
+  }
+  if (res < 0) {
+    conn->wrote_err = true;
+    return;
+  }
+  out_buf_advance(conn, res);
+
+  /* Error in outputting if already wrote EOF but still stuff in the output
+     queue. */
+  if (conn->wrote_eof && !conn->wrote_err && conn->out_len == 0)
+    conn->wrote_err = true;
+
+  /* Write out the rest, then let student code know there is space if it was
+     running out. */
+  conn_drain(conn);
+  if (res > 0 && held_up && !conn->delete_me)
+    ctcp_output(conn->state);
+}
+
+/**
+ * Handles a completed io_uring request.
+ *
+ * cqe: The completion.
+ */
+void uring_complete(struct io_uring_cqe *cqe) {
+  conn_t *conn = (conn_t *) (cqe->user_data & ~(uint64_t) UR_KIND_MASK);
+
+  switch (cqe->user_data & UR_KIND_MASK) {
+  /* Packet received on the socket. */
+  case UR_RECV:
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      char *buf = uring.bufs + id * max_packet_size;
+      conn_t *rconn = NULL;
+      int len = cqe->res > 0 ? filter_pkt(buf, cqe->res, &rconn) : 0;
+      if (len >= FULL_HDR_SIZE)
+        handle_pkt(buf, len, rconn, false);
+      uring_recycle_buf(id);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      uring_recv();
+    break;
+
+  /* Input from stdin. Server will only send to most-recently connected
+     client. */
+  case UR_STDIN:
+    if (cqe->res & POLLIN)
+      stdin_read();
+    if (!stdin_eof)
+      uring_poll_stdin();
+    break;
+
+  /* Output from a running program. */
+  case UR_PROGRAM:
+    conn->uring_pending--;
+    if (conn->delete_me || cqe->res < 0)
+      break;
+    if (cqe->res & POLLIN)
+      ctcp_read(conn->state);
+    if (!conn->delete_me)
+      uring_poll_program(conn);
+    break;
+
+  case UR_WRITE:
+    conn->uring_pending--;
+    uring_write_done(conn, cqe->res);
+    break;
+
+  /* Output is writable again. */
+  case UR_WRITABLE:
+    conn->uring_pending--;
+    if (!conn->uring_cancelled && cqe->res >= 0)
+      conn_drain(conn);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/**
+ * Sets up the io_uring instance: maps the submission and completion rings and
+ * registers the receive buffers.
+ *
+ * returns: 0 on success, -1 if io_uring is not available.
+ */
+int uring_init() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (uring.fd < 0)
+    return -1;
+
+  /* Whatever is set up before a failure is undone at the end. */
+  char *ring = MAP_FAILED;
+  size_t ring_size = 0;
+  size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  size_t buf_ring_size = 0;
+  uring.sqes = MAP_FAILED;
+  uring.buf_ring = MAP_FAILED;
+  uring.bufs = NULL;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG))
+    goto fail;
+
+  /* Map the rings. Both share one mapping. */
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+  uring.sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (ring == MAP_FAILED || uring.sqes == MAP_FAILED)
+    goto fail;
+
+  uring.sq_head = (unsigned *) (ring + p.sq_off.head);
+  uring.sq_tail = (unsigned *) (ring + p.sq_off.tail);
+  uring.sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned *) (ring + p.sq_off.array);
+  uring.sq_entries = p.sq_entries;
+  uring.cq_head = (unsigned *) (ring + p.cq_off.head);
+  uring.cq_tail = (unsigned *) (ring + p.cq_off.tail);
+  uring.cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+  /* Register the receive buffers. At least one batch worth, rounded up to a
+     power of 2. */
+  uring.num_bufs = 8;
+  while (uring.num_bufs < recv_batch)
+    uring.num_bufs <<= 1;
+  buf_ring_size = uring.num_bufs * sizeof(struct io_uring_buf);
+  uring.buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  uring.bufs = calloc(uring.num_bufs, max_packet_size);
+  if (uring.buf_ring == MAP_FAILED || uring.bufs == NULL)
+    goto fail;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) uring.buf_ring;
+  reg.ring_entries = uring.num_bufs;
+  reg.bgid = UR_BUF_GROUP;
+  if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0)
+    goto fail;
+
+  unsigned short i;
+  for (i = 0; i < uring.num_bufs; i++)
+    uring_recycle_buf(i);
+  return 0;
+
+fail:
+  free(uring.bufs);
+  uring.bufs = NULL;
+  if (uring.buf_ring != MAP_FAILED)
+    munmap(uring.buf_ring, buf_ring_size);
+  if (uring.sqes != MAP_FAILED)
+    munmap(uring.sqes, sqes_size);
+  if (ring != MAP_FAILED)
+    munmap(ring, ring_size);
+  close(uring.fd);
+  return -1;
+}
+
+/**
+ * Waits for outstanding writes to finish. Used before exiting so queued
+ * output is not lost. A write that finds the output full is queued again once
+ * the output is writable.
+ */
+void uring_finish_writes() {
+  conn_t *conn;
+  bool writing = true;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->out_len > 0 && conn->uring_pending == 0 && !conn->wrote_err)
+      uring_write(conn);
+  }
+
+  while (writing) {
+    /* Only writes and waits for the output to become writable are left. */
+    writing = false;
+    for (conn = get_connections(); conn; conn = conn->next)
+      writing |= conn->uring_pending > 0 && !conn->wrote_err;
+    if (!writing || uring_enter(POLL_INTERVAL) < 0)
+      break;
+
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+      unsigned kind = cqe->user_data & UR_KIND_MASK;
+      conn = (conn_t *) (cqe->user_data & ~(uint64_t) UR_KIND_MASK);
+
+      if (kind == UR_WRITE) {
+        conn->uring_pending--;
+        conn->uring_writing = false;
+        if (cqe->res == -EAGAIN)
+          uring_poll_writable(conn);
+        else if (cqe->res < 0)
+          conn->wrote_err = true;
+        else {
+          out_buf_advance(conn, cqe->res);
+          if (conn->out_len > 0 && cqe->res > 0)
+            uring_write(conn);
+        }
+      }
+      else if (kind == UR_WRITABLE) {
+        conn->uring_pending--;
+        if (cqe->res < 0)
+          conn->wrote_err = true;
+        else if (conn->out_len > 0)
+          uring_write(conn);
+      }
+      head++;
+      __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+
+/////////////////////////////// WORKER THREADS ////////////////////////////////
+
+/**
+ * Picks the worker thread that owns the connection a packet belongs to.
+ *
+ * buf: The packet.
+ * returns: The worker.
+ */
+struct worker *worker_for(char *buf) {
+  iphdr_t *ip_hdr = (iphdr_t *) buf;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
+
+  uint32_t hash = ntohs(tcp_hdr->th_sport);
+  if (!unix_socket)
+    hash ^= ip_hdr->saddr;
+  hash *= 2654435761u;
+  return &workers[hash % num_workers];
+}
+
+/**
+ * Hands off a packet to a worker thread. The worker is woken up later, by
+ * worker_wake().
+ *
+ * w: The worker.
+ * pkt: Buffer holding the packet. The worker takes it.
+ */
+void worker_queue(struct worker *w, struct seg_buf *pkt) {
+  pkt->next = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->num_pkts < WORKER_QUEUE_MAX) {
+    *w->pkts_tail = pkt;
+    w->pkts_tail = &pkt->next;
+    w->num_pkts++;
+    pkt = NULL;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  /* Worker is falling behind. Drop the packet. */
+  if (pkt)
+    seg_buf_put(pkt);
+  w->woken = true;
+}
+
+/**
+ * Wakes up worker threads that packets have been handed off to.
+ */
+void worker_wake() {
+  uint64_t one = 1;
+  int i;
+  for (i = 0; i < num_workers; i++) {
+    if (workers[i].woken) {
+      workers[i].woken = false;
+      write(workers[i].wakeup, &one, sizeof(one));
+    }
+  }
+}
+
+/**
+ * Replaces the buffer of a receive slot whose packet was passed on.
+ *
+ * i: The slot.
+ */
+void recv_refill(int i) {
+  recv_slots[i] = seg_buf_get();
+  recv_iovs[i].iov_base = recv_slots[i]->pkt + (udp ? SEG_OFFSET : 0);
+}
+
+/**
+ * Receives packets on the socket and hands them off to the worker threads.
+ */
+void recv_dispatch() {
+  int n, i;
+
+  do {
+    n = recvmmsg(config->socket, recv_msgs, recv_batch, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++) {
+      char *buf = recv_iovs[i].iov_base;
+      if (recv_msgs[i].msg_len >= FULL_HDR_SIZE) {
+        recv_slots[i]->len = recv_msgs[i].msg_len;
+        worker_queue(worker_for(buf), recv_slots[i]);
+        recv_refill(i);
+      }
+    }
+    worker_wake();
+  } while (n == recv_batch);
+}
+
+/**
+ * Handles the packets handed off to the worker of the current thread.
+ */
+void worker_drain() {
+  uint64_t n;
+  read(worker->wakeup, &n, sizeof(n));
+
+  pthread_mutex_lock(&worker->lock);
+  struct seg_buf *pkt = worker->pkts;
+  worker->pkts = NULL;
+  worker->pkts_tail = &worker->pkts;
+  worker->num_pkts = 0;
+  pthread_mutex_unlock(&worker->lock);
+
+  while (pkt != NULL) {
+    struct seg_buf *next = pkt->next;
+    conn_t *conn = NULL;
+    int len = filter_pkt(pkt->pkt, pkt->len, &conn);
+    if (len < FULL_HDR_SIZE || !handle_pkt(pkt->pkt, len, conn, true))
+      seg_buf_put(pkt);
+    pkt = next;
+  }
+}
+
+/**
+ * Parses a comma-separated list of CPUs to run worker threads on.
+ *
+ * list: The list.
+ * returns: 0 on success, -1 if the list is invalid.
+ */
+int parse_worker_cpus(char *list) {
+  char *cpu;
+  for (cpu = strtok(list, ","); cpu; cpu = strtok(NULL, ",")) {
+    if (num_worker_cpus == MAX_WORKERS || atoi(cpu) < 0 ||
+        atoi(cpu) >= CPU_SETSIZE)
+      return -1;
+    worker_cpus[num_worker_cpus++] = atoi(cpu);
+  }
+  return num_worker_cpus > 0 ? 0 : -1;
+}
+
+
+////////////////////////////// PIPELINE THREADS ///////////////////////////////
+
+/**
+ * Main loop of the input thread of pipeline mode. Reads STDIN into the input
+ * slots, waiting whenever all of them are full, until EOF.
+ *
+ * arg: Unused.
+ */
+void *in_ring_run(void *arg) {
+  uint64_t n = 1;
+
+  while (true) {
+    unsigned tail = in_ring.tail;
+    if (tail - __atomic_load_n(&in_ring.head, __ATOMIC_ACQUIRE) == IN_SLOTS) {
+      read(in_ring.space, &n, sizeof(n));
+      continue;
+    }
+
+    struct in_slot *slot = &in_ring.slots[tail % IN_SLOTS];
+    int r = read(STDIN_FILENO, slot->data, IN_SLOT_SIZE);
+    if (r < 0 && errno == EINTR)
+      continue;
+
+    /* Errors are treated like EOF. */
+    slot->len = r > 0 ? r : 0;
+    __atomic_store_n(&in_ring.tail, tail + 1, __ATOMIC_RELEASE);
+    n = 1;
+    write(in_ring.ready, &n, sizeof(n));
+    if (r <= 0)
+      return NULL;
+  }
+}
+
+int in_ring_fill(conn_t *conn) {
+  /* Input left over from the previous connection goes to this one. */
+  conn_t *holder = in_ring.holder;
+  if (holder && holder != conn && holder->in_len > 0) {
+    conn->in_data = holder->in_data;
+    conn->in_head = holder->in_head;
+    conn->in_len = holder->in_len;
+    holder->in_len = 0;
+    in_ring.holder = conn;
+    return conn->in_len;
+  }
+
+  /* Give back the slot handed out last. */
+  uint64_t n = 1;
+  if (in_ring.held) {
+    in_ring.held = false;
+    __atomic_store_n(&in_ring.head, in_ring.head + 1, __ATOMIC_RELEASE);
+    write(in_ring.space, &n, sizeof(n));
+  }
+
+  unsigned head = in_ring.head;
+  if (head == __atomic_load_n(&in_ring.tail, __ATOMIC_ACQUIRE)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  /* Hand out the slot in place. It is given back on the next call. */
+  struct in_slot *slot = &in_ring.slots[head % IN_SLOTS];
+  in_ring.held = true;
+  in_ring.holder = conn;
+  conn->in_data = slot->data;
+  return slot->len;
+}
+
+/**
+ * Main loop of the output thread of pipeline mode. Writes out whatever has
+ * been pushed to the output ring, sleeping whenever it is empty.
+ *
+ * arg: Unused.
+ */
+void *out_ring_run(void *arg) {
+  struct iovec iov[2];
+  uint64_t n = 1;
+
+  while (true) {
+    size_t head = out_ring.head;
+    size_t tail = __atomic_load_n(&out_ring.tail, __ATOMIC_ACQUIRE);
+
+    /* Nothing to write out. Sleep until there is, making sure not to miss a
+       push in between. */
+    if (head == tail) {
+      if (__atomic_load_n(&out_ring.done, __ATOMIC_ACQUIRE))
+        return NULL;
+      __atomic_store_n(&out_ring.sleeping, true, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&out_ring.tail, __ATOMIC_SEQ_CST) == head &&
+          !__atomic_load_n(&out_ring.done, __ATOMIC_SEQ_CST))
+        read(out_ring.ready, &n, sizeof(n));
+      __atomic_store_n(&out_ring.sleeping, false, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    /* Write out everything, even if it wraps around the end of the ring. */
+    size_t start = head % out_ring.cap;
+    size_t len = tail - head;
+    int iovcnt = 1;
+    iov[0].iov_base = out_ring.buf + start;
+    iov[0].iov_len = len;
+    if (start + len > out_ring.cap) {
+      iov[0].iov_len = out_ring.cap - start;
+      iov[1].iov_base = out_ring.buf;
+      iov[1].iov_len = len - iov[0].iov_len;
+      iovcnt = 2;
+    }
+    int w = writev(STDOUT_FILENO, iov, iovcnt);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0) {
+      __atomic_store_n(&out_ring.err, true, __ATOMIC_RELEASE);
+      w = len;
+    }
+
+    /* Let the main thread know if student code may have been short of
+       space. */
+    bool full = out_ring.cap - len < max_seg_size;
+    __atomic_store_n(&out_ring.head, head + w, __ATOMIC_RELEASE);
+    if (full) {
+      n = 1;
+      write(out_ring.space, &n, sizeof(n));
+    }
+  }
+}
+
+size_t out_ring_space() {
+  size_t head = __atomic_load_n(&out_ring.head, __ATOMIC_ACQUIRE);
+  return out_ring.cap - (out_ring.tail - head);
+}
 
-  /* Set window size for the other host. */
-  ctcp_cfg->send_window = ntohs(synack->window);
+int out_ring_push(const char *buf, size_t len) {
+  if (__atomic_load_n(&out_ring.err, __ATOMIC_ACQUIRE))
+    return -1;
 
-  /* If an ACK is received instead of a SYN-ACK, continue previous
-     connection. Get sequence numbers from previous connection. */
-  if ((synack->th_flags & TH_SYN) == 0) {
-    config->sconn->init_seqno = ntohl(synack->th_ack) - 1;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq) - 1;
+  size_t space = out_ring_space();
+  if (len > space)
+    len = space;
 
-    config->sconn->next_seqno = config->sconn->init_seqno + 1;
-    config->sconn->ackno = ntohl(synack->th_seq);
+  /* Copy into the free space, wrapping around. */
+  size_t tail = out_ring.tail;
+  size_t start = tail % out_ring.cap;
+  size_t first = out_ring.cap - start;
+  if (len <= first) {
+    memcpy(out_ring.buf + start, buf, len);
   }
-
-  /* Otherwise, set new acknowledgement number and send ACK response */
   else {
-    config->sconn->next_seqno++;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq);
-    config->sconn->ackno = ntohl(synack->th_seq) + 1;
-    send_ack(config->sconn);
+    memcpy(out_ring.buf + start, buf, first);
+    memcpy(out_ring.buf, buf + first, len - first);
   }
+  __atomic_store_n(&out_ring.tail, tail + len, __ATOMIC_SEQ_CST);
 
-  return config->sconn;
+  /* Wake up the output thread if it is sleeping. */
+  if (__atomic_load_n(&out_ring.sleeping, __ATOMIC_SEQ_CST)) {
+    uint64_t n = 1;
+    write(out_ring.ready, &n, sizeof(n));
+  }
+  return len;
 }
 
 /**
- * [Server only]
- * Handle a new connection from a client. Set up connection details and
- * initialize sequence numbers.
- *
- * pkt: The SYN segment from the client.
- * returns: The conn_t associated with the new connection.
+ * Starts the input and output threads of pipeline mode. STDIN and STDOUT are
+ * left blocking for them, and the main thread polls the eventfds of the rings
+ * instead.
  */
-conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
-  /* Ignore if too many clients are connected. */
-  if (num_connected >= MAX_NUM_CLIENTS) {
-    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
-            MAX_NUM_CLIENTS);
-    return NULL;
+void start_pipeline() {
+  pthread_t thread;
+
+  if (!send_file) {
+    in_ring.slots = malloc(IN_SLOTS * sizeof(struct in_slot));
+    in_ring.ready = eventfd(0, EFD_NONBLOCK);
+    in_ring.space = eventfd(0, 0);
+    events[STDIN_FILENO].fd = in_ring.ready;
+    pthread_create(&thread, NULL, in_ring_run, NULL);
+    pthread_detach(thread);
   }
-  num_connected++;
-
-  iphdr_t *ip_hdr = (iphdr_t *) pkt;
-  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
-
-  /* Set up connection details and add to list of connections. */
-  conn_t *conn = calloc(sizeof(conn_t), 1);
-  conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
-  conn->their_init_seqno = ntohl(syn->th_seq);
-  conn->ackno = conn->their_init_seqno + 1;
-  conn_add(conn);
-
-  /* Send a SYN-ACK to the client. */
-  send_synack(conn);
 
-  /* Get window size of the client. */
-  ctcp_cfg->send_window = ntohs(syn->window);
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
-
-  /* Student code. */
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
-  conn->state = state;
+  out_ring.cap = out_buf_max;
+  out_ring.buf = malloc(out_ring.cap);
+  out_ring.ready = eventfd(0, 0);
+  out_ring.space = eventfd(0, EFD_NONBLOCK);
+  events[STDOUT_FILENO].fd = out_ring.space;
+  events[STDOUT_FILENO].events = POLLIN;
+  pthread_create(&out_ring.thread, NULL, out_ring_run, NULL);
+}
 
-  fprintf(stderr, "[INFO] Client connected\n");
-  return conn;
+/**
+ * Waits for the output thread of pipeline mode to write out everything pushed
+ * to it.
+ */
+void finish_pipeline() {
+  uint64_t n = 1;
+  __atomic_store_n(&out_ring.done, true, __ATOMIC_SEQ_CST);
+  write(out_ring.ready, &n, sizeof(n));
+  pthread_join(out_ring.thread, NULL);
 }
 
 
@@ -1109,6 +4296,11 @@ void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
     conn->stdin = PARENT_WRITE_FD;
     conn->stdout = PARENT_READ_FD;
 
+    /* Splice output into the program's pipe, if enabled. */
+    conn->out_splice = splice_setup(conn->stdin);
+    conn->prog_pipe.fd = conn->stdin;
+    pthread_mutex_init(&conn->prog_pipe.lock, NULL);
+
     /* Start polling the stdout. */
     int id = NUM_POLL + num_connected - 1;
     struct pollfd *stdout = &events[id];
@@ -1116,6 +4308,8 @@ void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
     async(stdout->fd);
     stdout->events = POLLIN | POLLHUP;
     conn->poll_fd = stdout;
+    if (use_uring)
+      uring_poll_program(conn);
   }
 }
 
@@ -1127,8 +4321,323 @@ void delete_all_connections() {
   conn_t *conn, *next;
   for (conn = get_connections(); conn != NULL; conn = next) {
     next = conn->next;
-    if (conn->delete_me)
-      conn_free(conn);
+    if (!conn->delete_me)
+      continue;
+
+    /* io_uring requests still refer to this connection. Cancel them and free
+       it once they have all completed. */
+    if (conn->uring_pending > 0) {
+      if (!conn->uring_cancelled)
+        uring_cancel(conn);
+      continue;
+    }
+
+    /* Output of the client's other stripes still goes through this one. */
+    if (conn->stripes && conn->stripes->out == conn &&
+        stripes_busy(conn->stripes))
+      continue;
+    conn_free(conn);
+  }
+}
+
+/**
+ * Handles a packet received on the socket that has passed filter_pkt().
+ * Packets from established connections are passed to student code, and SYNs
+ * start new connections.
+ *
+ * buf: The raw IP packet.
+ * len: Length of the packet.
+ * conn: Connection the packet is associated with, or NULL if none.
+ * pooled: Whether buf is the packet of a packet buffer that can be taken. If
+ *         so, the segment passed to student code is made from it in place.
+ * returns: true if the packet buffer was taken, false if the caller keeps it.
+ */
+bool handle_pkt(char *buf, int len, conn_t *conn, bool pooled) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
+
+  /* Packet from an established connection. Pass to student code. */
+  if (conn != NULL) {
+    uint16_t sport = tcp_hdr->th_sport;
+    ctcp_segment_t *segment = pooled ? convert_to_ctcp_in_place(conn, buf) :
+                                       convert_to_ctcp(conn, buf, len);
+    len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
+
+    /* Don't log or forward to student code if it's an ACK from a new
+       connection. */
+    if (sport == new_connection &&
+        (segment->flags & TH_ACK) &&
+        ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
+      new_connection = 0;
+      segment_free(segment);
+    }
+    else {
+      if (log_file != -1 || test_debug_on) {
+        log_segment(log_file, config->ip_addr, config->port, conn,
+                    segment, len, false, unix_socket);
+      }
+      ctcp_receive(conn->state, segment, len);
+    }
+    return pooled;
+  }
+
+  iphdr_t *ip_hdr = (iphdr_t *) buf;
+  int sport = ntohs(tcp_hdr->th_sport);
+  uint16_t stripe = ntohs(tcp_hdr->th_urp);
+
+  /* Answer from a server this client is connecting to. */
+  if (!SERVER) {
+    conn = conn_find(config->connecting, ip_hdr->saddr, sport, stripe);
+    if (conn != NULL)
+      tcp_connected(conn, buf);
+  }
+
+  /* A SYN from a client that is already connected means the SYN-ACK was
+     lost. Send it again. */
+  else if ((tcp_hdr->th_flags & TH_SYN) &&
+           (conn = conn_find(get_connections(), ip_hdr->saddr, sport,
+                             stripe)) &&
+           conn->their_init_seqno == ntohl(tcp_hdr->th_seq)) {
+    send_synack(conn);
+  }
+
+  /* New connection. */
+  else if (tcp_hdr->th_flags & TH_SYN) {
+    conn = tcp_new_connection(buf);
+
+    /* Start a new program associated with this client. */
+    if (run_program && conn)
+      execute_program(conn);
+    new_connection = tcp_hdr->th_sport;
+
+    /* STDIN goes to the most recent connection. */
+    if (worker && conn)
+      __atomic_store_n(&stdin_owner, worker, __ATOMIC_RELAXED);
+  }
+  return false;
+}
+
+/**
+ * [UDP only]
+ * Handles a cTCP segment received in a UDP datagram. Same as handle_pkt(),
+ * except that the segment is passed to student code as it is.
+ *
+ * segment: The segment, allocated with segment_alloc().
+ * len: Length of the segment.
+ * from: Address of the sender.
+ * returns: true if the segment was taken, false if the caller keeps it.
+ */
+bool udp_handle(ctcp_segment_t *segment, int len, struct sockaddr_in *from) {
+  conn_t *conn;
+  if (len < (int) sizeof(ctcp_segment_t))
+    return false;
+
+  for (conn = get_connections(); conn != NULL; conn = conn->next) {
+    if (conn->saddr.sin_port == from->sin_port &&
+        conn->saddr.sin_addr.s_addr == from->sin_addr.s_addr)
+      break;
+  }
+
+  /* A SYN from a client that is already connected means the SYN-ACK was
+     lost. A SYN-ACK is from a server this client is connecting to, or left
+     over from the handshake. */
+  if (segment->flags & TH_SYN) {
+    if (!SERVER) {
+      conn = conn_find(config->connecting, from->sin_addr.s_addr,
+                       ntohs(from->sin_port), 0);
+      if (conn != NULL && (segment->flags & TH_ACK))
+        udp_connected(conn, segment, len);
+    }
+    else if (conn != NULL)
+      udp_send_conn_seg(conn, TH_SYN | TH_ACK);
+    else {
+      conn = udp_new_connection(segment, len, from);
+
+      /* Start a new program associated with this client. */
+      if (run_program && conn)
+        execute_program(conn);
+    }
+    return false;
+  }
+
+  /* Segment from an established connection. Pass to student code. */
+  if (conn == NULL)
+    return false;
+  if (log_file != -1 || test_debug_on) {
+    log_segment(log_file, config->ip_addr, config->port, conn,
+                segment, len, false, unix_socket);
+  }
+  ctcp_receive(conn->state, segment, len);
+  return true;
+}
+
+/**
+ * Allocates the receive buffers used by recv_drain(). With --udp, datagrams
+ * are received straight into place as segments, or into larger buffers if
+ * the kernel joins them up (GRO).
+ */
+void recv_batch_init() {
+  int i;
+  recv_msgs = calloc(recv_batch, sizeof(struct mmsghdr));
+  recv_iovs = calloc(recv_batch, sizeof(struct iovec));
+  recv_slots = calloc(recv_batch, sizeof(struct seg_buf *));
+  if (udp)
+    recv_addrs = calloc(recv_batch, sizeof(struct sockaddr_in));
+  if (udp_gro) {
+    recv_gro_bufs = malloc(recv_batch * GRO_BUF_SIZE);
+    recv_cmsgs = calloc(recv_batch, sizeof(*recv_cmsgs));
+  }
+
+  for (i = 0; i < recv_batch; i++) {
+    struct msghdr *hdr = &recv_msgs[i].msg_hdr;
+    if (udp_gro) {
+      recv_iovs[i].iov_base = recv_gro_bufs + i * GRO_BUF_SIZE;
+      recv_iovs[i].iov_len = GRO_BUF_SIZE;
+      hdr->msg_control = recv_cmsgs[i];
+    }
+    else {
+      recv_refill(i);
+      recv_iovs[i].iov_len = max_packet_size - (udp ? SEG_OFFSET : 0);
+    }
+    if (udp)
+      hdr->msg_name = &recv_addrs[i];
+    hdr->msg_iov = &recv_iovs[i];
+    hdr->msg_iovlen = 1;
+  }
+}
+
+/**
+ * [UDP only]
+ * Same as recv_drain(), for datagrams carrying cTCP segments. Datagrams the
+ * kernel joined up are split back up at the size it reports, and each one is
+ * copied into a segment of its own.
+ */
+void udp_drain() {
+  int n, i;
+
+  do {
+    for (i = 0; i < recv_batch; i++) {
+      recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      if (udp_gro)
+        recv_msgs[i].msg_hdr.msg_controllen = sizeof(*recv_cmsgs);
+    }
+
+    n = recvmmsg(config->socket, recv_msgs, recv_batch, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++) {
+      struct msghdr *hdr = &recv_msgs[i].msg_hdr;
+      char *buf = recv_iovs[i].iov_base;
+      int len = recv_msgs[i].msg_len;
+      if (!udp_gro) {
+        if (udp_handle((ctcp_segment_t *) buf, len, &recv_addrs[i]))
+          recv_refill(i);
+        continue;
+      }
+
+      /* Size of each of the datagrams that were joined up, if they were. */
+      int size = len;
+      struct cmsghdr *cmsg;
+      for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+          size = *(int *) CMSG_DATA(cmsg);
+      }
+      if (size <= 0)
+        continue;
+
+      int off, seg_len;
+      for (off = 0; off < len; off += size) {
+        seg_len = len - off < size ? len - off : size;
+        if (seg_len > (int) (max_packet_size - SEG_OFFSET))
+          break;
+        ctcp_segment_t *segment = segment_alloc(seg_len);
+        memcpy(segment, buf + off, seg_len);
+        if (!udp_handle(segment, seg_len, &recv_addrs[i]))
+          segment_free(segment);
+      }
+    }
+  } while (n == recv_batch);
+}
+
+/**
+ * Drains the socket. Packets are received up to recv_batch at a time with a
+ * single recvmmsg() call, and each one is filtered and handled in order. Keeps
+ * going as long as full batches are being received.
+ */
+void recv_drain() {
+  int n, i;
+
+  if (udp) {
+    udp_drain();
+    return;
+  }
+
+  do {
+    n = recvmmsg(config->socket, recv_msgs, recv_batch, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++) {
+      conn_t *conn = NULL;
+      char *buf = recv_iovs[i].iov_base;
+      int len = filter_pkt(buf, recv_msgs[i].msg_len, &conn);
+      if (len >= FULL_HDR_SIZE && handle_pkt(buf, len, conn, true))
+        recv_refill(i);
+    }
+  } while (n == recv_batch);
+}
+
+/**
+ * Main loop for the io_uring backend. Same as do_loop(), except that all
+ * waiting, receiving and output happens through the io_uring instance: one
+ * system call both submits new requests and waits for completions.
+ */
+void uring_loop() {
+  uring_recv();
+  if (!run_program && events[STDIN_FILENO].fd >= 0)
+    uring_poll_stdin();
+
+  while (true) {
+    long timeout = input_pending() ? 0 :
+      impair_timeout(need_timer_in(&last_timeout, ctcp_cfg->timer));
+    if (uring_enter(timeout) < 0) {
+      fprintf(stderr, "[ERROR] io_uring_enter failed\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /* Handle all completions. */
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+      uring_complete(&uring.cqes[head & *uring.cq_mask]);
+      head++;
+      __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /* Read-ahead input left over. */
+    read_pending();
+
+    /* Check if timer is up. */
+    if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
+      ctcp_timer();
+      splice_timer();
+      syn_timer();
+      get_time(&last_timeout);
+    }
+
+    /* Send delayed segments that are due. */
+    impair_timer();
+
+    /* Send everything queued up during this pass. */
+    send_flush();
+
+    /* Delete connections if needed. */
+    delete_all_connections();
+  }
+}
+
+/**
+ * Main loop of a sharded server's main thread. Hands off the packets received
+ * on the socket to the worker threads, which do everything else.
+ */
+void dispatch_loop() {
+  while (true) {
+    poll(&events[2], 1, -1);
+    if (events[2].revents & POLLIN)
+      recv_dispatch();
   }
 }
 
@@ -1140,25 +4649,46 @@ void delete_all_connections() {
  *   - Timeouts.
  */
 void do_loop() {
-  char buf[MAX_PACKET_SIZE];
   conn_t *conn = NULL;
 
+  if (use_uring) {
+    uring_loop();
+    return;
+  }
+  if (num_workers > 0 && !worker) {
+    dispatch_loop();
+    return;
+  }
+  uint64_t n;
+
   while (true) {
-    memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+    /* Only the worker thread with the most recent connection reads from
+       stdin. */
+    if (worker) {
+      bool owner = __atomic_load_n(&stdin_owner, __ATOMIC_RELAXED) == worker;
+      events[STDIN_FILENO].fd = owner && !send_file ? STDIN_FILENO : -1;
+    }
+
+    poll(events, NUM_POLL + num_connected, input_pending() || loop_head ? 0 :
+         impair_timeout(need_timer_in(&last_timeout, ctcp_cfg->timer)));
 
     /* Input from stdin. Server will only send to most-recently connected
        client. */
-    if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
-      conn = get_connections();
+    if (!run_program && events[STDIN_FILENO].revents & (POLLIN | POLLHUP)) {
+      if (pipeline)
+        read(in_ring.ready, &n, sizeof(n));
+      stdin_read();
 
-      if (conn != NULL)
-        ctcp_read(conn->state);
+      /* A client only reads STDIN once. Stop polling it after EOF. */
+      conn = get_connections();
+      if (!SERVER && (stdin_eof || (conn != NULL && conn->read_eof)))
+        events[STDIN_FILENO].fd = -1;
     }
 
     /* See if we can output more. */
-    if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR)) {
+    if (events[STDOUT_FILENO].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) {
+      if (pipeline)
+        read(out_ring.space, &n, sizeof(n));
       for (conn = get_connections(); conn; conn = conn->next) {
         conn_drain(conn);
       }
@@ -1176,80 +4706,176 @@ void do_loop() {
       }
     }
 
-    /* Receive packet on socket from other hosts. Ignore packets if they are
-       not large enough or not for us. */
-    if (events[2].revents & POLLIN) {
-      conn = NULL;
-      int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
-      if (len >= FULL_HDR_SIZE) {
-        tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-
-        /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
-          ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
-          len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
-
-          /* Don't log or forward to student code if it's an ACK from a new
-             connection. */
-          if (tcp_hdr->th_sport == new_connection &&
-              (segment->flags & TH_ACK) &&
-              ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
-            new_connection = 0;
-            free(segment);
-          }
-          else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
-            }
-            ctcp_receive(conn->state, segment, len);
-          }
-        }
-
-        /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
-          conn_t *conn = tcp_new_connection(buf);
+    /* Read-ahead input left over. */
+    read_pending();
 
-          /* Start a new program associated with this client. */
-          if (run_program && conn)
-            execute_program(conn);
-          new_connection = tcp_hdr->th_sport;
-        }
-      }
+    /* Receive packets on socket from other hosts. Packets are dropped if they
+       are not large enough or not for us. */
+    if (events[2].revents & POLLIN) {
+      if (worker)
+        worker_drain();
+      else
+        recv_drain();
     }
 
+    /* Segments between the two ends of a loopback connection. */
+    if (loopback)
+      loop_drain();
+
     /* Check if timer is up. */
     if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
       ctcp_timer();
+      splice_timer();
+      syn_timer();
       get_time(&last_timeout);
     }
 
+    /* Send delayed segments that are due. */
+    impair_timer();
+
+    /* Send everything queued up during this pass. */
+    send_flush();
+
     /* Delete connections if needed. */
     delete_all_connections();
   }
 }
 
+/**
+ * Main loop of a worker thread of a sharded server. Sets up polling for the
+ * thread, then runs the main loop on the connections the thread owns.
+ *
+ * arg: The worker.
+ */
+void *worker_run(void *arg) {
+  worker = arg;
+
+  /* Pin to a CPU, if configured. */
+  if (worker->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  events = calloc(NUM_POLL + MAX_NUM_CLIENTS, sizeof(struct pollfd));
+  events[STDIN_FILENO].fd = -1;
+  events[STDIN_FILENO].events = POLLIN | POLLHUP | POLLERR;
+  events[STDOUT_FILENO].fd = STDOUT_FILENO;
+  events[STDOUT_FILENO].events = POLLOUT | POLLERR;
+  events[2].fd = worker->wakeup;
+  events[2].events = POLLIN;
+  send_batch_init();
+
+  do_loop();
+  return NULL;
+}
+
+/**
+ * Starts the worker threads of a sharded server.
+ */
+void start_workers() {
+  int i;
+  workers = calloc(num_workers, sizeof(struct worker));
+  for (i = 0; i < num_workers; i++) {
+    struct worker *w = &workers[i];
+    w->cpu = num_worker_cpus ? worker_cpus[i % num_worker_cpus] : -1;
+    w->wakeup = eventfd(0, EFD_NONBLOCK);
+    w->pkts_tail = &w->pkts;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_create(&w->thread, NULL, worker_run, w);
+  }
+  fprintf(stderr, "[INFO] Started %d worker threads\n", num_workers);
+}
+
+/**
+ * Works out the most data this host takes in a segment, once it is known
+ * whether connections stay on this machine, and sizes packet buffers, windows
+ * and output buffers from it. Packets that leave the machine have to fit in
+ * an Ethernet frame.
+ */
+void seg_size_init() {
+  bool local = unix_socket || loopback;
+  if (max_seg_size == 0)
+    max_seg_size = local ? LOCAL_SEG_DATA_SIZE : MAX_SEG_DATA_SIZE;
+  if (!local && max_seg_size > MAX_SEG_DATA_SIZE)
+    max_seg_size = MAX_SEG_DATA_SIZE;
+  max_packet_size = FULL_HDR_SIZE + max_seg_size;
+  seg_pool_max = SEG_POOL_MAX * MAX_PACKET_SIZE / max_packet_size;
+
+  /* Windows are in segments, but are sent in 16 bits. */
+  long win = (long) window * max_seg_size;
+  ctcp_cfg->recv_window = win > UINT16_MAX ? UINT16_MAX : win;
+  ctcp_cfg->send_window = ctcp_cfg->recv_window;
+  ctcp_cfg->max_seg_size = max_seg_size;
+
+  /* A full segment has to fit in the output buffer, or it could never be
+     output. */
+  if (out_buf_size < max_seg_size)
+    out_buf_size = max_seg_size;
+  if (out_buf_max < out_buf_size)
+    out_buf_max = out_buf_size;
+
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->out_cap < out_buf_size)
+      out_buf_grow(conn, out_buf_size);
+  }
+}
+
 /**
  * Setup config for polling.
  */
 void setup_poll() {
-  /* Poll for input from stdin. */
+  /* Poll for input from stdin, unless sending a file instead. */
   struct pollfd *stdin = &events[STDIN_FILENO];
-  stdin->fd = STDIN_FILENO;
+  stdin->fd = send_file ? -1 : STDIN_FILENO;
   stdin->events = POLLIN | POLLHUP | POLLERR;
-  async(STDIN_FILENO);
+  if (!pipeline)
+    async(STDIN_FILENO);
 
   /* Poll stdout to do asynchronous output.. */
   struct pollfd *stdout = &events[STDOUT_FILENO];
   stdout->fd = STDOUT_FILENO;
   stdout->events = POLLOUT | POLLERR;
-  async(STDOUT_FILENO);
+  if (!pipeline)
+    async(STDOUT_FILENO);
+
+  /* Hand off STDIN and STDOUT to their own threads in pipeline mode. */
+  if (pipeline)
+    start_pipeline();
+
+  /* A client has nothing to send STDIN to until a server is connected (see
+     conn_connected()). Nor anything to output: STDOUT is always writable,
+     so polling it would only spin. */
+  stdin_poll_fd = stdin->fd;
+  stdout_poll_fd = stdout->fd;
+  if (!SERVER && get_connections() == NULL) {
+    stdin->fd = -1;
+    stdout->fd = -1;
+  }
+
+  /* Splice output into STDOUT, if enabled and it is a pipe. */
+  if (!run_program && !pipeline)
+    stdout_splice = splice_setup(STDOUT_FILENO);
 
   /* Poll for segments from the server. */
   struct pollfd *socket = &events[2];
   socket->fd = config->socket;
   socket->events = POLLIN | POLLHUP | POLLERR;
-  async(config->socket);
+  recv_batch_init();
+  send_batch_init();
+
+  /* The io_uring backend waits on the socket itself. Sends never block since
+     they are done with MSG_DONTWAIT. Worker threads and pipeline mode only
+     use poll(). */
+  if (use_uring &&
+      (num_workers > 0 || pipeline || loopback || udp || uring_init() < 0)) {
+    fprintf(stderr, "[INFO] io_uring not available, using poll\n");
+    use_uring = false;
+  }
+  if (!use_uring && !loopback)
+    async(config->socket);
 
   /* Used to detect if a network service has closed. */
   signal(SIGPIPE, SIG_IGN);
@@ -1264,33 +4890,133 @@ void end_client() {
     fprintf(stderr, "[INFO] Client disconnected\n");
     return;
   }
+
+  /* In loopback mode, the receiving end has to be done. By then the sending
+     end is only waiting in case its last ACK was lost, and nobody is left to
+     retransmit a FIN. */
+  conn_t *conn;
+  if (loopback && !loop_receiver->delete_me)
+    return;
+
+  /* Write out output that is still buffered. */
+  struct pollfd out = { .fd = STDOUT_FILENO, .events = POLLOUT };
+  for (conn = get_connections(); conn; conn = conn->next) {
+    while (!pipeline && !use_uring && !conn->wrote_err &&
+           conn->out_len > conn->out_pipe) {
+      poll(&out, 1, -1);
+      out_buf_flush(conn);
+    }
+  }
+
+  /* Other servers are still connected, or still being connected to. */
+  if (!loopback) {
+    if (config->connecting != NULL)
+      return;
+    for (conn = get_connections(); conn; conn = conn->next) {
+      if (!conn->delete_me)
+        return;
+    }
+  }
+
+  send_flush();
+  if (use_uring)
+    uring_finish_writes();
+  if (pipeline)
+    finish_pipeline();
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->recv)
+      recv_file_finish(conn);
+  }
   delete_all_connections();
-  close(config->socket);
+  if (!loopback)
+    close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
-  exit(EXIT_SUCCESS);
+  if (opt_stats)
+    stats_print();
+  exit(connect_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * [Client only]
+ * Sets up a connection for each stripe of the input to the server (see
+ * --stripes). They connect at the same time, like connections to several
+ * servers.
+ */
+void stripes_setup() { ASSERT_CLIENT_ONLY;
+  conn_t *server = config->connecting;
+  int i;
+
+  server->stripe = num_stripes << 8 | 1;
+  for (i = 1; i < num_stripes; i++) {
+    conn_t *conn = calloc(sizeof(conn_t), 1);
+    conn_setup(conn, server->ip_addr, server->port, unix_socket);
+    conn->stripe = num_stripes << 8 | (i + 1);
+    conn->next = config->connecting;
+    config->connecting = conn;
+  }
 }
 
 /**
- * Start a client.
+ * Start a client, connecting to all of its servers at once.
  *
- * server: String containing the server to connect to.
+ * servers: Strings containing the servers to connect to.
+ * num_servers: Number of servers.
  * port: The port the client will run on.
  */
-int start_client(char *server, char *port) {
-  if (do_config_server(server) < 0 || do_config(port) < 0)
+int start_client(char **servers, int num_servers, char *port) {
+  int i;
+  config->sconn = NULL;
+  config->connecting = NULL;
+  for (i = 0; i < num_servers; i++) {
+    if (do_config_server(servers[i]) < 0)
+      return -1;
+  }
+  if (num_stripes > 0)
+    stripes_setup();
+  if (do_config(port) < 0)
     return -1;
+  seg_size_init();
 
-  /* Initialize connection with server. Go to student code. */
-  conn_t *conn = tcp_handshake();
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
-  if (state == NULL) {
-    fprintf(stderr, "[ERROR] Could not connect to server!\n");
-    return -1;
+  /* Send the SYNs. The main loop waits for the SYN-ACKs, and goes to student
+     code for each server as it answers. */
+  setup_poll();
+  connect_servers();
+  do_loop();
+  return 0;
+}
+
+/**
+ * Start a loopback connection: a client end that sends STDIN and a server end
+ * that outputs to STDOUT, connected to each other in this process. Needs no
+ * socket or handshake.
+ */
+int start_loopback() {
+  memset(config, 0, sizeof(struct config));
+  config->socket = -1;
+  config->ip_addr = LOCALHOST;
+  seg_size_init();
+
+  /* The receiving end does not read any input. The sending end is added last,
+     so it gets STDIN. */
+  loop_receiver = calloc(sizeof(conn_t), 1);
+  conn_add(loop_receiver);
+  loop_receiver->read_eof = true;
+  recv_file_claim(loop_receiver);
+  conn_t *sender = calloc(sizeof(conn_t), 1);
+  conn_add(sender);
+  sender->peer = loop_receiver;
+  loop_receiver->peer = sender;
+
+  /* Go to student code. */
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+    memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+    conn->state = ctcp_init(conn, config_copy);
+    if (conn->state == NULL)
+      return -1;
   }
-  fprintf(stderr, "[INFO] Connected to server\n");
-  config->sconn->state = state;
+  fprintf(stderr, "[INFO] Loopback connected\n");
 
   setup_poll();
   do_loop();
@@ -1307,6 +5033,7 @@ int start_client(char *server, char *port) {
 int start_server(char *port, int argc, char *argv[]) {
   if (do_config(port) < 0)
     return -1;
+  seg_size_init();
 
   /* Keep track of program to start and its arguments. */
   if (argc - optind > 0) {
@@ -1314,10 +5041,16 @@ int start_server(char *port, int argc, char *argv[]) {
     config->program = argv[optind];
     config->argc = argc - optind;
     config->argv = argv + optind;
+
+    /* Programs have their own pipes. Pipeline mode only covers STDIN and
+       STDOUT. */
+    pipeline = false;
   }
   fprintf(stderr, "[INFO] Server started\n");
 
   setup_poll();
+  if (num_workers > 0)
+    start_workers();
   do_loop();
   return 0;
 }
@@ -1330,7 +5063,7 @@ int start_server(char *port, int argc, char *argv[]) {
 static void usage(char *progname) {
   fprintf(stderr,
     "\nUsage: %s\n"
-    "   -c server_host:server_port  [client only]\n"
+    "   -c server_host:server_port  [client only, repeatable]\n"
     "   -s                          [server only]\n"
     "   -p port\n"
     "   [-d]\n"
@@ -1340,12 +5073,49 @@ static void usage(char *progname) {
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--rate kbit_per_sec]\n"
+    "   [--latency ms]\n"
+    "   [--jitter ms]\n"
+    "   [--reorder reorder_percent]\n"
+    "   [--burst-loss p,r[,bad_loss[,good_loss]]]\n"
+    "   [--queue num_segments]\n"
+    "   [--recv-batch num_packets]\n"
+    "   [--send-batch num_packets]\n"
+    "   [--io-uring]\n"
+    "   [--out-buf bytes]\n"
+    "   [--out-buf-max bytes]\n"
+    "   [--splice]\n"
+    "   [--send-file path]\n"
+    "   [--recv-file path]\n"
+    "   [--threads num_threads]     [server only]\n"
+    "   [--cpus cpu1,cpu2,...]      [server only]\n"
+    "   [--pipeline]\n"
+    "   [--loopback]                [instead of -c/-s/-p]\n"
+    "   [--udp]\n"
+    "   [--mss bytes]\n"
+    "   [--stripes num_stripes]     [client only]\n"
+    "   [--stats]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
   exit(1);
 }
 
+/**
+ * Parses the size of a buffer given as an option.
+ *
+ * str: The option's argument.
+ * returns: The size in bytes, or -1 if it is not a number from 1 to INT_MAX.
+ */
+static long parse_buf_size(char *str) {
+  char *end;
+  errno = 0;
+  long size = strtol(str, &end, 10);
+  if (errno != 0 || end == str || *end != '\0' || size <= 0 || size > INT_MAX)
+    return -1;
+  return size;
+}
+
 int main(int argc , char *argv[]) {
   /* Get program name. */
   char *progname = strrchr(argv[0], '/');
@@ -1357,10 +5127,10 @@ int main(int argc , char *argv[]) {
   /* Possible command-line arguments. */
   bool is_server = 0;
   bool is_client = 0;
-  char *server = NULL;
+  char *servers[MAX_NUM_SERVERS];
+  int num_servers = 0;
   char *port_str = NULL;
   int port = -1;
-  int window = 1;
   seed = time(NULL);
   test_debug_on = false;
   lab5_mode = false;
@@ -1377,8 +5147,30 @@ int main(int argc , char *argv[]) {
     { "corrupt", required_argument, NULL, 't' },
     { "delay", required_argument, NULL, 'y' },
     { "duplicate", required_argument, NULL, 'q' },
+    { "rate", required_argument, NULL, 'R' },
+    { "latency", required_argument, NULL, 'L' },
+    { "jitter", required_argument, NULL, 'J' },
+    { "reorder", required_argument, NULL, 'O' },
+    { "burst-loss", required_argument, NULL, 'B' },
+    { "queue", required_argument, NULL, 'Q' },
     { "logging", no_argument, NULL, 'l' },
     { "lab5", no_argument, NULL, 'f' },
+    { "recv-batch", required_argument, NULL, 'b' },
+    { "send-batch", required_argument, NULL, 'a' },
+    { "io-uring", no_argument, NULL, 'u' },
+    { "out-buf", required_argument, NULL, 'o' },
+    { "out-buf-max", required_argument, NULL, 'x' },
+    { "splice", no_argument, NULL, 'v' },
+    { "send-file", required_argument, NULL, 'm' },
+    { "recv-file", required_argument, NULL, 'k' },
+    { "threads", required_argument, NULL, 'n' },
+    { "cpus", required_argument, NULL, 'g' },
+    { "pipeline", no_argument, NULL, 'i' },
+    { "loopback", no_argument, NULL, 'j' },
+    { "stats", no_argument, NULL, 'h' },
+    { "udp", no_argument, NULL, 'U' },
+    { "mss", required_argument, NULL, 'M' },
+    { "stripes", required_argument, NULL, 'S' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1394,10 +5186,13 @@ int main(int argc , char *argv[]) {
     case 's':
       is_server = true;
       break;
-    /* Run as client and connect to a specified server. */
+    /* Run as client and connect to a specified server. Can be given more
+       than once to connect to several servers at once. */
     case 'c':
+      if (num_servers == MAX_NUM_SERVERS)
+        usage(progname);
       is_client = true;
-      server = optarg;
+      servers[num_servers++] = optarg;
       break;
     /* Port to run on. */
     case 'p':
@@ -1428,6 +5223,45 @@ int main(int argc , char *argv[]) {
     case 'q':
       opt_duplicate = atoi(optarg);
       break;
+    /* Bottleneck rate of the emulated link. */
+    case 'R':
+      link_rate = atol(optarg);
+      opt_link = true;
+      break;
+    /* Propagation delay of the emulated link. */
+    case 'L':
+      link_latency = atof(optarg) * 1000;
+      opt_link = true;
+      break;
+    /* Most the propagation delay varies by. */
+    case 'J':
+      link_jitter = atof(optarg) * 1000;
+      opt_link = true;
+      break;
+    /* Segments that skip the propagation delay. */
+    case 'O':
+      link_reorder = atof(optarg) / 100;
+      opt_link = true;
+      break;
+    /* Gilbert-Elliott loss: chances of going into and out of the bad state,
+       and of loss in the bad and good states, in percent. */
+    case 'B': {
+      double p = 0, r = 100, bad = 100, good = 0;
+      if (sscanf(optarg, "%lf,%lf,%lf,%lf", &p, &r, &bad, &good) < 2)
+        usage(progname);
+      ge_p = p / 100;
+      ge_r = r / 100;
+      ge_bad_loss = bad / 100;
+      ge_good_loss = good / 100;
+      opt_link = true;
+      break;
+    }
+    /* Length of the drop-tail queue in front of the bottleneck. */
+    case 'Q':
+      link_queue = atoi(optarg);
+      if (link_queue < 1)
+        usage(progname);
+      break;
     /* Turn logging on. */
     case 'l':
       log_file = 0;
@@ -1440,6 +5274,88 @@ int main(int argc , char *argv[]) {
     case 'f':
       lab5_mode = true;
       break;
+    /* Number of packets received per system call. */
+    case 'b':
+      recv_batch = atoi(optarg);
+      if (recv_batch < 1 || recv_batch > MAX_RECV_BATCH)
+        usage(progname);
+      break;
+    /* Number of datagrams sent per system call. */
+    case 'a':
+      send_batch = atoi(optarg);
+      if (send_batch < 1 || send_batch > MAX_SEND_BATCH)
+        usage(progname);
+      break;
+    /* Use the io_uring backend, if available. */
+    case 'u':
+      use_uring = true;
+      break;
+    /* Size of the output buffer of each connection. */
+    case 'o':
+      if (parse_buf_size(optarg) < 0)
+        usage(progname);
+      out_buf_size = parse_buf_size(optarg);
+      break;
+    /* Size the output buffer may grow to. */
+    case 'x':
+      if (parse_buf_size(optarg) < 0)
+        usage(progname);
+      out_buf_max = parse_buf_size(optarg);
+      break;
+    /* Splice output into pipes. */
+    case 'v':
+      opt_splice = true;
+      break;
+    /* Send a file instead of reading from STDIN. */
+    case 'm':
+      if (send_file_map(optarg) < 0)
+        return 1;
+      break;
+    /* Receive into a file instead of writing to STDOUT. */
+    case 'k':
+      if (recv_file_open(optarg) < 0)
+        return 1;
+      break;
+    /* Number of worker threads. */
+    case 'n':
+      num_workers = atoi(optarg);
+      if (num_workers < 1 || num_workers > MAX_WORKERS)
+        usage(progname);
+      break;
+    /* CPUs to run worker threads on. */
+    case 'g':
+      if (parse_worker_cpus(optarg) < 0)
+        usage(progname);
+      break;
+    /* Read STDIN and write STDOUT on their own threads. */
+    case 'i':
+      pipeline = true;
+      break;
+    /* Connect a client and server end to each other in this process. */
+    case 'j':
+      loopback = true;
+      break;
+    /* Print what was sent on exit. */
+    case 'h':
+      opt_stats = true;
+      break;
+    /* Carry segments in UDP datagrams. */
+    case 'U':
+      udp = true;
+      unix_socket = false;
+      break;
+    /* Most data to take in a segment. */
+    case 'M':
+      if (atoi(optarg) < 1 || atoi(optarg) > MAX_LOCAL_SEG_DATA_SIZE)
+        usage(progname);
+      max_seg_size = atoi(optarg);
+      break;
+    /* Spread the input over several connections to the server. */
+    case 'S':
+      if (atoi(optarg) < 1 || atoi(optarg) > MAX_STRIPES)
+        usage(progname);
+      num_stripes = atoi(optarg);
+      break;
     default:
       usage(progname);
       break;
@@ -1449,11 +5365,32 @@ int main(int argc , char *argv[]) {
   /* Seed RNG. */
   srand(seed);
 
+  /* Output buffers must hold a whole pipe to splice into (see
+     splice_setup()). Sized here, before any worker threads start. */
+  if (opt_splice && out_buf_size < SPLICE_PIPE_SIZE)
+    out_buf_size = SPLICE_PIPE_SIZE;
+
+  /* Output buffer can't shrink below its initial size. */
+  if (out_buf_max < out_buf_size)
+    out_buf_max = out_buf_size;
+
   /* Validate arguments. */
-  if ((is_client && is_server) || (!is_client && !is_server) || port <= 0) {
+  if ((is_client && is_server) || (!is_client && !is_server && !loopback) ||
+      (loopback && (is_client || is_server || num_workers > 0)) ||
+      (port <= 0 && !loopback) ||
+      (is_client && num_workers > 0) || (pipeline && num_workers > 0) ||
+      (udp && (loopback || num_workers > 0)) ||
+      (num_stripes > 0 && (!is_client || num_servers != 1 || udp ||
+                           pipeline))) {
     usage(progname);
   }
 
+  /* A server runs until it is interrupted. Print the stats then. */
+  if (opt_stats && is_server) {
+    signal(SIGINT, stats_signal);
+    signal(SIGTERM, stats_signal);
+  }
+
   /* Construct log file if logging is turned on. Don't create a file if not
      logging data, since that is only used for testing purposes. */
   if (log_file == 0) {
@@ -1474,8 +5411,6 @@ int main(int argc , char *argv[]) {
   /* CTCP config for students. */
   static ctcp_config_t cfg;
   ctcp_cfg = &cfg;
-  cfg.recv_window = window * MAX_SEG_DATA_SIZE;
-  cfg.send_window = window * MAX_SEG_DATA_SIZE;
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
 
@@ -1485,8 +5420,14 @@ int main(int argc , char *argv[]) {
   events = _events;
 
   /* Start client/server. */
-  if (is_client) {
-    if (start_client(server, port_str) < 0) {
+  if (loopback) {
+    if (start_loopback() < 0) {
+      fprintf(stderr, "[ERROR] Loopback terminated\n");
+      return 1;
+    }
+  }
+  else if (is_client) {
+    if (start_client(servers, num_servers, port_str) < 0) {
       fprintf(stderr, "[ERROR] Client terminated\n");
       return 1;
     }
@@ -9,6 +9,8 @@
 #ifndef CTCP_SYS_INTERNAL_H
 #define CTCP_SYS_INTERNAL_H
 
+#include <pthread.h>
+
 #include "ctcp.h"
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
@@ -24,15 +26,89 @@
 /** Maximum number of clients that can connect to the server. */
 #define MAX_NUM_CLIENTS 10
 
+/** Maximum number of servers a client can connect to at once (see -c). */
+#define MAX_NUM_SERVERS 64
+
+/** Most connections a client's input can be striped over (see --stripes). */
+#define MAX_STRIPES 8
+
+/** Most input a client puts in one chunk when striping. */
+#define STRIPE_CHUNK_SIZE (64 * 1024)
+
+/** Size of the header in front of each chunk: its sequence number and length,
+    both 32 bits in network order. */
+#define STRIPE_HDR_SIZE 8
+
+/** Most data a server holds for a striped client in chunks that are further
+    ahead of the one it outputs next than the client has stripes. */
+#define STRIPE_BUF_SPACE (16 << 20)
+
 /** Default number of things to poll (stdin, stdout, socket). */
 #define NUM_POLL 3
 
 /** Polling interval in milliseconds. */
 #define POLL_INTERVAL 20
 
+/** Default and maximum number of packets received per recvmmsg() call. */
+#define RECV_BATCH 32
+#define MAX_RECV_BATCH 1024
+
+/** Default and maximum number of datagrams queued before a sendmmsg() call. */
+#define SEND_BATCH 32
+#define MAX_SEND_BATCH 1024
+
+/** Number of submission queue entries for the io_uring backend. */
+#define URING_ENTRIES 256
+
+/** Maximum number of worker threads of a sharded server. */
+#define MAX_WORKERS 64
+
+/** Longest a segment is held back for with --delay, in milliseconds. */
+#define MAX_DELAY 5000
+
+/** Default length of the drop-tail queue in front of an emulated bottleneck
+    (see --rate), in segments. */
+#define LINK_QUEUE 100
+
+/** Maximum number of packets queued for a worker thread. More are dropped. */
+#define WORKER_QUEUE_MAX 4096
+
+/** Most free packet buffers kept for reuse by each thread, if they are
+    MAX_PACKET_SIZE bytes long. More are freed. Fewer larger buffers are kept,
+    so that the pool takes up the same space. */
+#define SEG_POOL_MAX 1024
+
+/** Default most data this host takes in a segment when connections are on
+    the same machine (see --mss). */
+#define LOCAL_SEG_DATA_SIZE 16384
+
+/** Most connections the raw socket's filter matches one by one. With more, it
+    only matches the port. */
+#define FILTER_MAX_CONNS 60
+
+/** Most datagrams and bytes sent in one UDP GSO send, and the size of the
+    buffers that UDP GRO receives into. */
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_BYTES 65000
+#define GRO_BUF_SIZE 65536
+
+/** Size of the SYN and SYN-ACK segments sent with --udp: a cTCP header and
+    the most data the sender takes in a segment. */
+#define UDP_CONN_SEG_SIZE (sizeof(ctcp_segment_t) + sizeof(uint16_t))
+
+/** Number and size of the slots the input thread reads STDIN into in pipeline
+    mode. */
+#define IN_SLOTS 16
+#define IN_SLOT_SIZE (64 * 1024)
+
 /** Length of time to wait while sending resets in seconds. */
 #define RESET_THREAD_DURATION 1
 
+/** Time to wait for a SYN-ACK before sending the SYN again, in milliseconds.
+    Doubles each time, up to SYN_INTERVAL_MAX, until CONN_TIMEOUT is up. */
+#define SYN_INTERVAL 200
+#define SYN_INTERVAL_MAX 3200
+
 /* Parameters to be changed by the tester. */
 
 /** Retransmission interval in milliseconds. */
@@ -61,20 +137,20 @@
 #define CHILD_READ_FD (pipes[PARENT_WRITE_PIPE][READ_FD])
 #define CHILD_WRITE_FD (pipes[PARENT_READ_PIPE][WRITE_FD])
 
-/** Maximum space for buffering STDOUT for a given connection. */
+/** Default space for buffering STDOUT for a given connection. */
 #define MAX_BUF_SPACE 8192
 
-/**
- * Chunk of output. Used to do asynchronous output. A connection will store
- * a queue of chunks to be outputted later.
- */
-struct chunk {
-  struct chunk *next;
-  size_t size;              /* Size of chunk, in bytes */
-  size_t used;              /* Amount of chunk already outputted */
-  char buf[1];              /* Data */
-} __attribute__((packed));
-typedef struct chunk chunk_t;
+/** Pipe buffer size requested for output pipes when splicing. */
+#define SPLICE_PIPE_SIZE (1 << 20)
+
+/** Space for reading ahead from STDIN for a given connection. */
+#define IN_BUF_SPACE (256 * 1024)
+
+/** Alignment of a file being sent, so that it can be mapped with huge pages. */
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/** Minimum amount a file being received into grows by at a time. */
+#define RECV_FILE_CHUNK (64 << 20)
 
 
 /**
@@ -144,7 +220,8 @@ typedef struct tcphdr tcphdr_t;
 #define TCP_HDR_SIZE sizeof(tcphdr_t)
 #define FULL_HDR_SIZE (sizeof(iphdr_t) + sizeof(tcphdr_t))
 
-/** Maximum packet size (data and headers). */
+/** Maximum packet size (data and headers) over the network. Packets between
+    hosts on the same machine may be larger (see max_packet_size). */
 #define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t))
 
 /** TCP pseudoheader, used in checksum calculations. */
@@ -180,6 +257,62 @@ bool add_network_line_ending(bool webserver, char *buf, size_t len) {
   return true;
 }
 
+/**
+ * Adds up data as 16-bit words in network order, the way cksum() does. Sums
+ * of pieces can be added together as long as each piece starts at an even
+ * offset of the checksummed data.
+ *
+ * sum: Sum of the data before this piece.
+ * _data: The piece.
+ * len: Length of the piece. Only the last piece may be of odd length.
+ * returns: The sum so far. Use cksum_fold() to get a checksum from it.
+ */
+uint32_t cksum_add(uint32_t sum, const void *_data, uint16_t len) {
+  const uint8_t *data = _data;
+
+  for (; len >= 2; data += 2, len -= 2)
+    sum += (data[0] << 8) | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  return sum;
+}
+
+/**
+ * Turns a sum from cksum_add() into a checksum.
+ *
+ * sum: The sum.
+ * returns: The checksum in network order, the same as cksum() over all the
+ *          data would give.
+ */
+uint16_t cksum_fold(uint32_t sum) {
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons(~sum);
+  return sum ? sum : 0xffff;
+}
+
+/**
+ * Adds the TCP pseudoheader and the TCP header of an IP packet to a sum, for
+ * the TCP checksum.
+ *
+ * packet: IP packet with a TCP payload. th_sum should be 0.
+ * len: Length of data (0 if no data and only TCP and IP headers).
+ * returns: The sum of the pseudoheader and TCP header.
+ */
+uint32_t cksum_tcp_hdrs(iphdr_t *packet, uint16_t len) {
+  tcp_pseudoheader_t phdr;
+  phdr.src_addr = packet->saddr;
+  phdr.dst_addr = packet->daddr;
+  phdr.placeholder = 0;
+  phdr.protocol = IPPROTO_TCP;
+  phdr.tcp_len = htons(TCP_HDR_SIZE + len);
+  memcpy(&phdr.tcp_hdr, (uint8_t *) packet + IP_HDR_SIZE, TCP_HDR_SIZE);
+  return cksum_add(0, &phdr, TCP_PSEUDOHDR_SIZE);
+}
+
 /**
  * Computes the TCP checksum. Returns the checksum in network order.
  *
@@ -189,41 +322,59 @@ bool add_network_line_ending(bool webserver, char *buf, size_t len) {
  * returns: The checksum in network order.
  */
 uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
-  tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
+  uint32_t sum = cksum_tcp_hdrs(packet, len);
+  return cksum_fold(cksum_add(sum, (uint8_t *) packet + FULL_HDR_SIZE, len));
+}
 
-  /* Construct pseudoheader. */
-  tcp_pseudoheader_t *phdr = calloc(TCP_PSEUDOHDR_SIZE + len, 1);
-  phdr->src_addr = packet->saddr;
-  phdr->dst_addr = packet->daddr;
-  phdr->protocol = IPPROTO_TCP;
-  phdr->tcp_len = htons(TCP_HDR_SIZE + len);
-
-  /* Append TCP segment and compute checksum. */
-  memcpy(&(phdr->tcp_hdr), tcp_hdr, TCP_HDR_SIZE + len);
-  uint16_t result = cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
-  free(phdr);
-  return result;
+/**
+ * Gets the maximum segment size (MSS) option of a TCP SYN or SYN-ACK.
+ *
+ * packet: IP packet with a TCP payload.
+ * returns: The MSS, or MAX_SEG_DATA_SIZE if the packet has no MSS option.
+ */
+uint16_t tcp_mss_option(iphdr_t *packet) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
+  uint8_t *opt = (uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+  int len = tcp_hdr->th_off * 4 - (int) TCP_HDR_SIZE;
+  if (len > ntohs(packet->tot_len) - (int) FULL_HDR_SIZE)
+    len = ntohs(packet->tot_len) - FULL_HDR_SIZE;
+
+  /* Options other than the end of the list and no-ops have a length. */
+  int i = 0;
+  while (i < len && opt[i] != TCPOPT_EOL) {
+    if (opt[i] == TCPOPT_NOP) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= len || opt[i + 1] < 2)
+      break;
+    if (opt[i] == TCPOPT_MAXSEG && opt[i + 1] == TCPOLEN_MAXSEG &&
+        i + TCPOLEN_MAXSEG <= len && (opt[i + 2] || opt[i + 3]))
+      return (opt[i + 2] << 8) | opt[i + 3];
+    i += opt[i + 1];
+  }
+  return MAX_SEG_DATA_SIZE;
 }
 
 /**
- * Creates an IP packet. The resulting packet must be freed by the caller.
- * Assumes arguments are in network order.
+ * Fills in the IP header at the start of a packet. Assumes arguments are in
+ * network order.
  *
+ * datagram: Where the packet starts.
  * src_ip: Source IP address.
  * dst_ip: Destination IP address.
  * len: Size of the IP packet payload.
- * returns: An IP packet of the specified length.
  */
-char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
-  uint16_t total_len = IP_HDR_SIZE + len;
-  char *datagram = calloc(total_len, 1);
+void fill_ip_hdr(char *datagram, in_addr_t src_ip, in_addr_t dst_ip,
+                 uint16_t len) {
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
+  memset(ip_hdr, 0, IP_HDR_SIZE);
 
   /* IP header. */
   ip_hdr->ihl |= 5;
   ip_hdr->version |= 4;
   ip_hdr->tos = 0;
-  ip_hdr->tot_len = htons(total_len);
+  ip_hdr->tot_len = htons(IP_HDR_SIZE + len);
   ip_hdr->id = htons(IP_ID);
   ip_hdr->frag_off = 0;
   ip_hdr->ttl = DEFAULT_TTL;
@@ -234,6 +385,20 @@ char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
 
   /* IP checksum. */
   ip_hdr->check = cksum(datagram, IP_HDR_SIZE);
+}
+
+/**
+ * Creates an IP packet. The resulting packet must be freed by the caller.
+ * Assumes arguments are in network order.
+ *
+ * src_ip: Source IP address.
+ * dst_ip: Destination IP address.
+ * len: Size of the IP packet payload.
+ * returns: An IP packet of the specified length.
+ */
+char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
+  char *datagram = calloc(IP_HDR_SIZE + len, 1);
+  fill_ip_hdr(datagram, src_ip, dst_ip, len);
   return datagram;
 }
 
@@ -252,7 +417,8 @@ void flipbit(const void *segment, size_t bit) {
 /**
  * Returns a random percentage between 0 and 100.
  *
- * level: The fork level (used in computing the random value).
+ * level: How many times the segment was held back or duplicated (used in
+ *        computing the random value).
  * returns: A random percentage.
  */
 int rand_percent(int level) {
@@ -265,6 +431,39 @@ int rand_percent(int level) {
 /** Ethernet interface prefix to determine the client's own IP address. */
 #define ETH_INTERFACE "eth"
 
+/** A pipe that output is spliced into. Several connections can splice into
+    the same one (STDOUT). Bytes leave it in the order they went in, so the
+    number read out of it in all tells which of each connection's bytes have
+    been read. */
+struct splice_pipe {
+  int fd;
+  uint64_t written;            /* Bytes spliced into it so far */
+  pthread_mutex_t lock;        /* Held while splicing into it or checking how
+                                  much has been read */
+};
+
+/** Bytes a connection spliced into a pipe with one call, by position in all
+    of the bytes spliced into the pipe. */
+struct splice_rec {
+  uint64_t start;
+  size_t len;
+};
+
+/** A file being received into instead of writing to STDOUT (see
+    --recv-file), mapped into memory. The file is allocated cap bytes at a
+    time and truncated to the end of the data at EOF. holes has a bit set for
+    each byte placed at or after base; everything before hwm has been placed. */
+struct recv_file {
+  int fd;
+  char *map;
+  size_t cap;
+  size_t end;
+  size_t hwm;
+  size_t base;
+  uint64_t *holes;
+  size_t words;
+};
+
 /** Connection details for a host connected to the current host. */
 struct conn {
   in_addr_t ip_addr;           /* IP address */
@@ -285,12 +484,60 @@ struct conn {
   struct pollfd *poll_fd;      /* Used for polling for output from program */
 
   bool read_eof;               /* EOF read from STDIN */
+  char *in_buf;                /* Read-ahead buffer for input from STDIN */
+  size_t in_head;              /* Start of the input not handed out yet */
+  size_t in_len;               /* Amount of input not handed out yet */
+  char *in_data;               /* Where input is handed out from: the
+                                  read-ahead buffer, or an input slot in
+                                  pipeline mode */
+  size_t in_off;               /* Offset of the next input in the file being
+                                  sent (see --send-file) */
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
   bool delete_me;              /* Whether or not to delete this object. */
 
-  chunk_t *out_queue;          /* Queue for output to STDOUT */
-  chunk_t **out_queue_tail;    /* End of the output queue */
+  char *out_buf;               /* Ring buffer for output to STDOUT. Used to do
+                                  asynchronous output */
+  size_t out_cap;              /* Capacity of the output buffer */
+  size_t out_head;             /* Offset of the next byte to output */
+  size_t out_len;              /* Number of bytes in the output buffer */
+  size_t out_pipe;             /* Bytes at the start of the output buffer that
+                                  were spliced into a pipe but may not have
+                                  been read yet. Can't be overwritten */
+  bool out_splice;             /* Output is spliced into a program's pipe */
+  struct splice_pipe prog_pipe;/* The program's pipe, if output is spliced
+                                  into it */
+  struct splice_rec *splices;  /* Spliced bytes not read yet, oldest first */
+  int splices_first;           /* Index of the oldest one */
+  int num_splices;             /* End of the spliced bytes in splices */
+  int splices_cap;             /* Capacity of splices */
+  bool out_blocked;            /* Student code was short of output space in
+                                  pipeline mode */
+  struct recv_file *recv;      /* File output is placed in, or NULL */
+  struct emu_link *link;       /* Emulated link segments are sent over (see
+                                  --rate and --latency), or NULL */
+  struct iovec out_iov[2];     /* Output buffer contents for io_uring writes */
+
+  int uring_pending;           /* io_uring requests referring to this object */
+  bool uring_writing;          /* io_uring write of the output buffer queued */
+  bool uring_cancelled;        /* Pending io_uring requests were cancelled */
+
+  struct conn *peer;           /* Other end of a loopback connection */
+
+  uint16_t stripe;             /* Stripe of a client's input this connection
+                                  carries, sent as the urgent pointer of each
+                                  packet: the number of stripes << 8 | the
+                                  index of this one + 1. 0 if not striped */
+  struct stripes *stripes;     /* [Server only] All stripes of the client */
+  struct chunk *chunk;         /* [Server only] Chunk being received */
+  char chunk_hdr[STRIPE_HDR_SIZE]; /* [Server only] Header of the next chunk */
+  size_t chunk_hdr_len;        /* Bytes of it received so far */
+  bool stripe_eof;             /* [Server only] EOF received on this stripe */
+
+  long syn_due;                /* [Client only] When to send the SYN again, in
+                                  microseconds, while connecting */
+  long syn_interval;           /* Time until then */
+  long syn_give_up;            /* When to give up connecting */
 
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
@@ -306,6 +553,128 @@ typedef struct conn conn_t;
  */
 void conn_add(conn_t *conn);
 
+/**
+ * Handles a packet received on the socket. See ctcp_sys_internal.c.
+ *
+ * buf: The raw IP packet.
+ * len: Length of the packet.
+ * conn: Connection the packet is associated with, or NULL if none.
+ * pooled: Whether buf is the packet of a packet buffer that can be taken.
+ * returns: true if the packet buffer was taken, false if the caller keeps it.
+ */
+bool handle_pkt(char *buf, int len, conn_t *conn, bool pooled);
+
+/**
+ * [io_uring backend only]
+ * Submits an asynchronous write of a connection's output buffer.
+ *
+ * conn: The connection object.
+ */
+void uring_write(conn_t *conn);
+
+/**
+ * [io_uring backend only]
+ * Waits until a connection's output can be written to again, then drains it.
+ *
+ * conn: The connection object.
+ */
+void uring_poll_writable(conn_t *conn);
+
+/**
+ * [io_uring backend only]
+ * Starts watching STDIN for input.
+ */
+void uring_poll_stdin();
+
+/**
+ * [io_uring backend only]
+ * Starts watching a program's STDOUT for output.
+ *
+ * conn: The connection object associated with the program.
+ */
+void uring_poll_program(conn_t *conn);
+
+/**
+ * [Server only]
+ * Checks how much output a stripe of a client can take. See
+ * ctcp_sys_internal.c.
+ *
+ * conn: The connection of the stripe.
+ * returns: The number of bytes that can be taken.
+ */
+size_t stripes_space(conn_t *conn);
+
+/**
+ * [Server only]
+ * Takes output of a stripe of a client. See ctcp_sys_internal.c.
+ *
+ * conn: The connection of the stripe.
+ * buf: The output.
+ * len: Length of the output, or 0 for EOF.
+ * returns: -1 if the output is not valid, otherwise len.
+ */
+int stripes_output(conn_t *conn, const char *buf, size_t len);
+
+/**
+ * [Server only]
+ * Outputs the chunks of a striped client that are next in order.
+ *
+ * s: The stripes of the client.
+ */
+void stripes_flush(struct stripes *s);
+
+/**
+ * [Server only]
+ * Takes a connection out of the stripes of its client.
+ *
+ * conn: The connection being freed.
+ */
+void stripes_leave(conn_t *conn);
+
+/**
+ * Cuts the file a connection received into down to the end of the data, and
+ * lets go of it.
+ *
+ * conn: The connection object.
+ */
+void recv_file_finish(conn_t *conn);
+
+/**
+ * Frees an emulated link.
+ *
+ * link: The link, or NULL.
+ */
+void link_free(struct emu_link *link);
+
+/**
+ * [Pipeline mode only]
+ * Hands out the next input slot filled by the input thread as a connection's
+ * read-ahead input.
+ *
+ * conn: The connection object.
+ * returns: The number of bytes in the slot, 0 on EOF, or -1 with errno set to
+ *          EAGAIN if no slot has been filled yet.
+ */
+int in_ring_fill(conn_t *conn);
+
+/**
+ * [Pipeline mode only]
+ * Gets the free space of the ring to the output thread.
+ *
+ * returns: The number of bytes that can be pushed.
+ */
+size_t out_ring_space();
+
+/**
+ * [Pipeline mode only]
+ * Pushes output to the output thread.
+ *
+ * buf: The output.
+ * len: Number of bytes to push.
+ * returns: The number of bytes pushed, or -1 if the output thread failed.
+ */
+int out_ring_push(const char *buf, size_t len);
+
 /**
  * Set up a conn_t object with the right values.
  *
@@ -404,7 +773,7 @@ in_addr_t ip_from_hostname(char *hostname) {
 
 /////////////////////////////////// LOGGING ////////////////////////////////////
 
-#define LOG_SIZE (4 * MAX_SEG_DATA_SIZE)
+#define LOG_SIZE (4 * MAX_LOCAL_SEG_DATA_SIZE)
 #define LOG_ENTRY_SIZE 20
 #define ADDR_FORMAT_STR "%s\t%d\t%s\t%d\t"
 #define LOCALHOST_STR "localhost"
@@ -493,7 +862,7 @@ void log_segment(int file, in_addr_t ip_addr, int port, conn_t *conn,
                  bool is_unix_socket) {
   /* Create output buffer and write IP addresses and ports. */
   char buf[LOG_SIZE];
-  memset(buf, 0, LOG_SIZE);
+  buf[0] = '\0';
 
   /* Timestamp. */
   snprintf(buf, LOG_ENTRY_SIZE, "%lu\t", current_time());